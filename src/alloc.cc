@@ -0,0 +1,93 @@
+#include "patty.hh"
+
+#include <array>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<std::uint64_t> allocations = 0;
+
+std::uint64_t heap_allocations()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+// Replaced globally, so allocations made by standard library are counted too
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+// Objects are grouped in size classes with one free list each. Freed object is pushed
+// on list of its class and reused by next allocation of the same class, new ones are
+// carved from blocks that are never returned to the system, so memory used by program
+// (read forms, boxes of values, list storage) lives in few big regions
+namespace
+{
+	constexpr std::size_t Granularity = 16;
+	constexpr std::size_t Classes = 16;
+	constexpr std::size_t Block_Size = 64 << 10;
+
+	struct Free_Node
+	{
+		Free_Node *next;
+	};
+
+	// Per thread, so workers of pmap and friends do not contend for it.
+	// Object freed by other thread than one that allocated it joins free list of former
+	struct Pools
+	{
+		std::array<Free_Node*, Classes> free{};
+		char *cursor = nullptr, *end = nullptr;
+	};
+
+	thread_local Pools pools;
+
+	inline std::size_t size_class(std::size_t size)
+	{
+		return (std::max<std::size_t>(size, 1) - 1) / Granularity;
+	}
+}
+
+void* pool_allocate(std::size_t size)
+{
+	if (size > Granularity * Classes)
+		return ::operator new(size);
+
+	auto const cls = size_class(size);
+	if (auto node = pools.free[cls]) {
+		pools.free[cls] = node->next;
+		return node;
+	}
+
+	auto const rounded = (cls + 1) * Granularity;
+	if (std::size_t(pools.end - pools.cursor) < rounded) {
+		// Rest of previous block is smaller than largest class and is abandoned
+		pools.cursor = static_cast<char*>(::operator new(Block_Size));
+		pools.end = pools.cursor + Block_Size;
+	}
+	return std::exchange(pools.cursor, pools.cursor + rounded);
+}
+
+void pool_release(void *p, std::size_t size)
+{
+	if (size > Granularity * Classes) {
+		::operator delete(p);
+		return;
+	}
+
+	auto &head = pools.free[size_class(size)];
+	head = new (p) Free_Node{head};
+}
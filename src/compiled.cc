@@ -0,0 +1,238 @@
+#include "patty.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+// File starts with magic and hash of source, followed by top-level forms in order.
+// Each value is tag followed by its payload. Symbol names are stored once, on first
+// occurrence, later ones refer to them by index
+static constexpr std::string_view Magic = "pattyc\x01\n";
+
+enum class Tag : std::uint8_t
+{
+	Nil,
+	Int,        // zigzag varint
+	String,     // varint length, bytes
+	New_Symbol, // varint length, bytes of name
+	Symbol,     // varint index of symbol introduced earlier
+	List,       // varint count, elements
+};
+
+std::uint64_t source_hash(std::string_view source)
+{
+	// Word at a time, since it is computed on every run of compiled program
+	constexpr std::uint64_t Multiplier = 0x9e3779b97f4a7c15ULL;
+	std::uint64_t hash = source.size() * Multiplier;
+	auto const mix = [&](std::uint64_t word) {
+		hash = (hash ^ word) * Multiplier;
+		hash ^= hash >> 29;
+	};
+
+	std::size_t i = 0;
+	for (; i + 8 <= source.size(); i += 8) {
+		std::uint64_t word;
+		std::memcpy(&word, source.data() + i, sizeof(word));
+		mix(word);
+	}
+	if (i < source.size()) {
+		std::uint64_t word = 0;
+		std::memcpy(&word, source.data() + i, source.size() - i);
+		mix(word);
+	}
+	return hash;
+}
+
+fs::path compiled_path(fs::path const& source)
+{
+	return fs::path(source).replace_extension(".pattyc");
+}
+
+Compiled_Writer::Compiled_Writer(fs::path const& path, std::uint64_t hash)
+	: path(path), temporary(fs::path(path) += ".tmp")
+{
+	file = std::fopen(temporary.c_str(), "wb");
+	if (!file)
+		error_fatal("cannot create file '{}'"_format(temporary.c_str()));
+	out.append(Magic);
+	out.append(reinterpret_cast<char const*>(&hash), sizeof(hash));
+}
+
+Compiled_Writer::~Compiled_Writer()
+{
+	if (file)
+		finish();
+}
+
+void Compiled_Writer::finish()
+{
+	flush();
+	if (std::fclose(std::exchange(file, nullptr)) != 0)
+		error_fatal("cannot write file '{}'"_format(temporary.c_str()));
+
+	// Renamed when complete, so other processes never load partially written file
+	std::error_code ec;
+	fs::rename(temporary, path, ec);
+	if (ec)
+		error_fatal("cannot create file '{}': {}"_format(path.c_str(), ec.message()));
+}
+
+void Compiled_Writer::write(Value const& form)
+{
+	encode(form);
+	if (out.size() >= 1 << 16)
+		flush();
+}
+
+void Compiled_Writer::flush()
+{
+	if (std::fwrite(out.data(), 1, out.size(), file) != out.size())
+		error_fatal("cannot write file '{}'"_format(temporary.c_str()));
+	out.clear();
+}
+
+void Compiled_Writer::varint(std::uint64_t n)
+{
+	for (; n >= 0x80; n >>= 7)
+		out.push_back(char(n | 0x80));
+	out.push_back(char(n));
+}
+
+void Compiled_Writer::encode(Value const& value)
+{
+	auto const tag = [&](Tag tag) { out.push_back(char(tag)); };
+
+	switch (value.type) {
+	case Value::Type::Nil:
+		tag(Tag::Nil);
+		return;
+
+	case Value::Type::Int:
+		tag(Tag::Int);
+		varint((std::uint64_t(value.ival) << 1) ^ std::uint64_t(value.ival >> 63));
+		return;
+
+	case Value::Type::String:
+		tag(Tag::String);
+		varint(value.sval().size());
+		out.append(value.sval());
+		return;
+
+	case Value::Type::Symbol:
+		if (auto [it, inserted] = symbols.try_emplace(value.symbol_id(), symbols.size()); !inserted) {
+			tag(Tag::Symbol);
+			varint(it->second);
+		} else {
+			tag(Tag::New_Symbol);
+			varint(value.sval().size());
+			out.append(value.sval());
+		}
+		return;
+
+	case Value::Type::List:
+		tag(Tag::List);
+		varint(value.list().size());
+		for (auto const& el : value.list())
+			encode(el);
+		return;
+
+	// Reader never produces them
+	case Value::Type::Cpp_Function:
+	case Value::Type::Sequence:
+	case Value::Type::Int_Vector:
+	case Value::Type::Memo_Function:
+		assert(false && "unreachable");
+	}
+}
+
+std::optional<Compiled_Reader> Compiled_Reader::open(std::string_view contents, std::uint64_t hash)
+{
+	if (!contents.starts_with(Magic) || contents.size() < Magic.size() + sizeof(hash))
+		return std::nullopt;
+	if (std::memcmp(contents.data() + Magic.size(), &hash, sizeof(hash)) != 0)
+		return std::nullopt;
+
+	Compiled_Reader reader;
+	reader.rest = contents.substr(Magic.size() + sizeof(hash));
+	return reader;
+}
+
+std::optional<Value> Compiled_Reader::next()
+{
+	if (rest.empty())
+		return std::nullopt;
+	return decode();
+}
+
+std::uint64_t Compiled_Reader::varint()
+{
+	std::uint64_t n = 0;
+	for (unsigned shift = 0;; shift += 7) {
+		if (rest.empty() || shift >= 64)
+			error_fatal("corrupted compiled program");
+		auto const byte = std::uint8_t(rest.front());
+		rest.remove_prefix(1);
+		n |= std::uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return n;
+	}
+}
+
+std::string_view Compiled_Reader::bytes()
+{
+	auto const size = varint();
+	if (size > rest.size())
+		error_fatal("corrupted compiled program");
+	auto const result = rest.substr(0, size);
+	rest.remove_prefix(size);
+	return result;
+}
+
+Value Compiled_Reader::decode()
+{
+	if (rest.empty())
+		error_fatal("corrupted compiled program");
+	auto const tag = Tag(rest.front());
+	rest.remove_prefix(1);
+
+	switch (tag) {
+	case Tag::Nil:
+		return Value::nil();
+
+	case Tag::Int:
+		{
+			auto const n = varint();
+			return Value::integer(std::int64_t(n >> 1) ^ -std::int64_t(n & 1));
+		}
+
+	case Tag::String:
+		return Value::string(bytes());
+
+	case Tag::New_Symbol:
+		{
+			auto symbol = Value::symbol(bytes());
+			symbols.push_back(symbol.symbol_id());
+			return symbol;
+		}
+
+	case Tag::Symbol:
+		{
+			auto const index = varint();
+			if (index >= symbols.size())
+				error_fatal("corrupted compiled program");
+			Value symbol(Value::Type::Symbol);
+			symbol.ival = symbols[index];
+			return symbol;
+		}
+
+	case Tag::List:
+		{
+			Value list(Value::Type::List);
+			auto &elements = list.mutable_list();
+			for (auto count = varint(); count > 0; --count)
+				elements.push_back(decode());
+			return list;
+		}
+	}
+
+	error_fatal("corrupted compiled program");
+}
@@ -2,25 +2,72 @@
 
 Context::Scope_Guard::~Scope_Guard()
 {
-	ctx->scopes.pop_back();
+	ctx->pop_scope();
 }
 
-Value* Context::operator[](std::string const& name)
+// Slow path, used for symbols that were not resolved
+Value* Context::operator[](Symbol_Id name)
 {
 	for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope)
-		if (scope->contains(name))
-			return &(*scope)[name];
+		if (auto it = std::find(R(scope->names), name); it != scope->names.end())
+			return &scope->values[std::distance(scope->names.begin(), it)];
+
+	if (name < global_slots.size() && global_slots[name] != No_Slot && globals[global_slots[name]].defined)
+		return &globals[global_slots[name]].value;
 	return nullptr;
 }
 
-void Context::assign(std::string const& name, Value value)
+Value* Context::operator[](Value const& symbol)
 {
-	scopes.back().emplace(name, std::move(value));
+	auto const& address = symbol.address;
+	switch (address.kind) {
+	case Value::Address::Kind::Local:
+		if (address.depth < scopes.size()) {
+			auto &scope = scopes[scopes.size() - address.depth - 1];
+			if (address.slot < scope.values.size())
+				return &scope.values[address.slot];
+		}
+		break;
+
+	case Value::Address::Kind::Global:
+		// Locals with the same name are dynamically visible in called functions
+		if (auto &global = globals[address.slot]; global.defined && global.shadowed == 0)
+			return &global.value;
+		break;
+
+	case Value::Address::Kind::Unresolved:
+		break;
+	}
+
+	return (*this)[symbol.symbol_id()];
+}
+
+void Context::assign(Symbol_Id name, Value value)
+{
+	if (scopes.empty()) {
+		if (auto &global = globals[global_slot(name)]; !global.defined) {
+			global.value = std::move(value);
+			global.defined = true;
+			++epoch;
+		}
+		return;
+	}
+
+	auto &scope = scopes.back();
+	if (std::find(R(scope.names), name) != scope.names.end())
+		return;
+
+	scope.names.push_back(name);
+	scope.values.push_back(std::move(value));
+	if (name < global_slots.size() && global_slots[name] != No_Slot) {
+		++globals[global_slots[name]].shadowed;
+		scope.shadowed.push_back(global_slots[name]);
+	}
 }
 
-void Context::Define_Descriptor::operator=(decltype(Value{}.cpp_function) func)
+void Context::Define_Descriptor::operator=(Intrinsic::Function function)
 {
-	ctx->assign(name, Value::cpp(name, std::move(func)));
+	ctx->assign(intern(name), Value::cpp(name, function));
 }
 
 Context::Define_Descriptor Context::define(char const* val)
@@ -30,6 +77,112 @@ Context::Define_Descriptor Context::define(char const* val)
 
 Context::Scope_Guard Context::local_scope()
 {
-	scopes.emplace_back();
+	push_scope();
 	return Scope_Guard{this};
 }
+
+// Every call pushes scope, so buffers of popped ones are reused instead of allocated again
+Context::Scope Context::new_scope()
+{
+	if (spare_scopes.empty())
+		return {};
+
+	auto scope = std::move(spare_scopes.back());
+	spare_scopes.pop_back();
+	return scope;
+}
+
+Context::Scope& Context::push_scope()
+{
+	return scopes.emplace_back(new_scope());
+}
+
+void Context::enter(Scope frame, Value const& formals)
+{
+	assert(frame.names.empty() && frame.values.size() == formals.list().size());
+	auto &scope = scopes.emplace_back(std::move(frame));
+	for (auto const& param : formals.list()) {
+		assert(param.type == Value::Type::Symbol);
+		auto const name = param.symbol_id();
+		scope.names.push_back(name);
+		if (name < global_slots.size() && global_slots[name] != No_Slot) {
+			++globals[global_slots[name]].shadowed;
+			scope.shadowed.push_back(global_slots[name]);
+		}
+	}
+}
+
+void Context::pop_scope()
+{
+	auto &scope = scopes.back();
+	for (auto slot : scope.shadowed)
+		--globals[slot].shadowed;
+
+	// Values are released now, not when scope is reused
+	scope.names.clear();
+	scope.values.clear();
+	scope.shadowed.clear();
+	spare_scopes.push_back(std::move(scope));
+	scopes.pop_back();
+}
+
+bool Context::rebinds_all(Value const& formals) const
+{
+	assert(!scopes.empty());
+	return std::ranges::all_of(scopes.back().names, [&](Symbol_Id name) {
+		return std::ranges::any_of(formals.list(), [&](Value const& param) {
+			return param.type == Value::Type::Symbol && param.symbol_id() == name;
+		});
+	});
+}
+
+// Global slots are reserved for names that are not defined yet (like recursive functions),
+// until definition they are resolved by slow path
+unsigned Context::global_slot(Symbol_Id name)
+{
+	if (name >= global_slots.size())
+		global_slots.resize(name + 1, No_Slot);
+
+	auto &slot = global_slots[name];
+	if (slot == No_Slot) {
+		slot = globals.size();
+		globals.push_back(Global{ .name = name, .value = {}, .defined = false, .shadowed = 0 });
+		// Locals that already hide this name must be counted as well
+		for (auto &scope : scopes) {
+			if (std::find(R(scope.names), name) != scope.names.end()) {
+				++globals.back().shadowed;
+				scope.shadowed.push_back(slot);
+			}
+		}
+	}
+	return slot;
+}
+
+Value::Address Context::address(Symbol_Id name, Lexical_Scopes const& lexical)
+{
+	using Kind = Value::Address::Kind;
+	Value::Address address;
+
+	if (std::find(R(lexical.unstable), name) != lexical.unstable.end())
+		return address;
+
+	for (auto scope = lexical.scopes.rbegin(); scope != lexical.scopes.rend(); ++scope) {
+		if (auto it = std::find(R(*scope), name); it != scope->end()) {
+			auto depth = std::uint32_t(std::distance(lexical.scopes.rbegin(), scope));
+			auto slot = std::uint32_t(std::distance(scope->begin(), it));
+			// Addresses that do not fit in Value are left for slow lookup by name
+			if (depth <= Value::Address::Max_Depth && slot <= Value::Address::Max_Slot) {
+				address.kind = Kind::Local;
+				address.depth = depth;
+				address.slot = slot;
+			}
+			return address;
+		}
+	}
+
+	if (auto slot = global_slot(name); slot <= Value::Address::Max_Slot) {
+		address.kind = Kind::Global;
+		address.slot = slot;
+	}
+	return address;
+}
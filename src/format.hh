@@ -11,11 +11,11 @@ struct fmt::formatter<Value> : fmt::formatter<std::string_view>
 			return fmt::format_to(fc.out(), "nil");
 		case Value::Type::String:
 			if (in_list)
-				return fmt::format_to(fc.out(), "{}", std::quoted(value.sval));
+				return fmt::format_to(fc.out(), "{}", std::quoted(value.sval()));
 			else
-				return fmt::format_to(fc.out(), "{}", value.sval);
+				return fmt::format_to(fc.out(), "{}", value.sval());
 		case Value::Type::Symbol:
-			return fmt::format_to(fc.out(), "{}", value.sval);
+			return fmt::format_to(fc.out(), "{}", value.sval());
 
 		case Value::Type::Int:
 			return fmt::format_to(fc.out(), "{}", value.ival);
@@ -25,12 +25,18 @@ struct fmt::formatter<Value> : fmt::formatter<std::string_view>
 
 		case Value::Type::List: {
 			in_list = true;
-			auto result = fmt::format_to(fc.out(), "({})", fmt::join(value.list, " "));
+			auto result = fmt::format_to(fc.out(), "({})", fmt::join(value.list(), " "));
 			in_list = false;
 			return result;
 		}
+		case Value::Type::Int_Vector:
+			return fmt::format_to(fc.out(), "({})", fmt::join(value.ints(), " "));
+
 		case Value::Type::Cpp_Function:
-			return fmt::format_to(fc.out(), "<cpp-function {}>", value.sval);
+			return fmt::format_to(fc.out(), "<cpp-function {}>", value.sval());
+
+		case Value::Type::Memo_Function:
+			return fmt::format_to(fc.out(), "<memo {}>", value.memo_function().function);
 		}
 
 		assert(false && "unreachable");
@@ -1,124 +1,318 @@
 #include "patty.hh"
 
-#include <iostream>
+#include <limits>
+#include <span>
 
-void intrinsics(Context &ctx)
+static Value sequence(Context &ctx, Value args, bool memoize)
 {
-	if (ctx.scopes.empty())
-		ctx.scopes.emplace_back();
+	if (args.is_static_expression(ctx)) {
+		auto gen = std::make_shared<Circular_Generator>();
+		gen->value_set = std::move(args);
+		return Value(std::move(gen));
+	} else {
+		auto &list = args.mutable_list();
+		auto end_of_statics = std::find_if(list.begin(), list.end(), [&ctx](auto &val) {
+			return !val.is_static_expression(ctx);
+		});
+
+		if (end_of_statics == list.begin()) {
+			auto gen = std::make_shared<Dynamic_Generator>();
+			gen->expr = std::move(args.at(0));
+			resolve(ctx, gen->expr, { intern("n") });
+			gen->specialize(ctx);
+			if (memoize)
+				gen->memo = std::make_shared<Dynamic_Generator::Memo>(Dynamic_Generator::Memo{{}, memo_limit});
+			return Value(std::move(gen));
+		} else {
+			auto composed = std::make_shared<Composed_Generator>();
+
+			auto circular = std::make_shared<Circular_Generator>();
+			circular->value_set = Value(Value::List(std::make_move_iterator(list.begin()), std::make_move_iterator(end_of_statics)));
+			composed->children.push_back(std::move(circular));
+
+			auto dynamic = std::make_shared<Dynamic_Generator>();
+			dynamic->expr = std::move(*end_of_statics);
+			resolve(ctx, dynamic->expr, { intern("n") });
+			dynamic->specialize(ctx);
+			if (memoize)
+				dynamic->memo = std::make_shared<Dynamic_Generator::Memo>(Dynamic_Generator::Memo{{}, memo_limit});
+			composed->children.push_back(std::move(dynamic));
+			composed->index_children(ctx);
+
+			if (auto recurrence = Recurrence_Generator::recognize(ctx, composed))
+				return Value(std::move(recurrence));
+			return Value(std::move(composed));
+		}
+	}
+}
 
-	// TODO division, modulo
-	static constexpr auto Math_Operations = std::array {
-		std::tuple { "+", &Value::operator+= },
-		std::tuple { "-", &Value::operator-= },
-		std::tuple { "*", &Value::operator*= }
-	};
+// Calls f with spans of consecutive elements of list or sequence, at most limit elements
+// in total. Sequences are pulled in chunks, so only one chunk of their elements is alive at a time
+static void for_each_chunk(Context &ctx, Value const& collection, std::size_t limit, auto &&f)
+{
+	switch (collection.type) {
+	case Value::Type::List:
+		{
+			auto const& list = collection.list();
+			f(std::span(list.begin(), std::min(limit, list.size())));
+			return;
+		}
 
-	for (auto [name, op] : Math_Operations) {
-		ctx.define(name) = [op = op](auto& ctx, Value args) {
-			assert(args.list.size() >= 1);
-			auto result = eval(ctx, args.at(0));
-			for (auto val : args.tail()) { (result.*op)(eval(ctx, std::move(val))); }
-			return result;
-		};
+	case Value::Type::Int_Vector:
+		{
+			auto const& ints = collection.ints();
+			auto const end = std::min(limit, ints.size());
+			std::vector<Value> chunk;
+			for (std::size_t i = 0; i < end; i += Sequence::Chunk_Size) {
+				for (auto j = i; j < std::min(i + Sequence::Chunk_Size, end); ++j)
+					chunk.push_back(Value::integer(ints[j]));
+				f(std::span<Value const>(chunk));
+				chunk.clear();
+			}
+			return;
+		}
+
+	case Value::Type::Sequence:
+		{
+			auto cursor = collection.sequence()->cursor();
+			std::vector<Value> chunk;
+			while (limit > 0) {
+				auto const wanted = std::min(Sequence::Chunk_Size, limit);
+				auto const pulled = cursor->next(ctx, chunk, wanted);
+				f(std::span<Value const>(chunk));
+				chunk.clear();
+				if (pulled < wanted)
+					return;
+				limit -= pulled;
+			}
+			return;
+		}
+
+	default:
+		error_fatal("expected list or sequence");
 	}
+}
 
-	static constexpr auto Equality = std::array {
-		std::tuple { "==", &Value::operator== },
-		std::tuple { "!=", &Value::operator!= }
-	};
+// Calls f with every element of list or sequence
+static void for_each(Context &ctx, Value const& collection, auto &&f)
+{
+	for_each_chunk(ctx, collection, std::numeric_limits<std::size_t>::max(), [&](std::span<Value const> chunk) {
+		for (auto const& el : chunk)
+			f(el);
+	});
+}
 
-	for (auto [name, op] : Equality) {
-		ctx.define(name) = [op = op](auto &ctx, Value args) {
-			assert(args.list.size() >= 1);
-			auto prev = eval(ctx, args.at(0));
-			for (auto val : args.tail()) {
-				auto curr = eval(ctx, std::move(val));
-				if (!(prev.*op)(curr)) {
-					return Value::integer(false);
-				}
-			}
-			return Value::integer(true);
-		};
+// Folds run of integers (integer values or elements of int vector) without evaluating
+// call for each of them. Loop over int vector is simple enough to be vectorized by the compiler
+template<typename Op, typename T>
+static int64_t fold_ints(int64_t acc, std::span<T const> values)
+{
+	for (auto const& value : values) {
+		if constexpr (std::is_same_v<T, Value>)
+			acc = Op{}(acc, value.ival);
+		else
+			acc = Op{}(acc, value);
 	}
+	return acc;
+}
 
-	static constexpr auto Comparisons = std::array {
-		std::tuple { "<",  +[](int64_t a, int64_t b) { return a < b; } },
-		std::tuple { "<=", +[](int64_t a, int64_t b) { return a <= b; } },
-		std::tuple { ">",  +[](int64_t a, int64_t b) { return a < b; } },
-		std::tuple { ">=",  +[](int64_t a, int64_t b) { return a < b; } },
-	};
+template<typename Op>
+static constexpr auto int_fold(std::string_view name)
+{
+	return std::tuple { name, &fold_ints<Op, Value>, &fold_ints<Op, int64_t> };
+}
 
-	for (auto [name, op] : Comparisons) {
-		ctx.define(name) = [op = op](auto& ctx, Value args) {
-			assert(args.list.size() >= 1);
-			auto prev = eval(ctx, args.at(0));
-			for (auto val : args.tail()) {
-				auto curr = eval(ctx, std::move(val));
-				if (!op(prev.ival, curr.ival))
-					return Value::integer(false);
-				prev = curr;
-			}
-			return Value::integer(true);
-		};
+// Integer kernels of intrinsics which fold recognizes as operation
+static constexpr auto Int_Folds = std::array {
+	int_fold<std::plus<int64_t>>("+"),
+	int_fold<std::minus<int64_t>>("-"),
+	int_fold<std::multiplies<int64_t>>("*"),
+	int_fold<std::equal_to<int64_t>>("=="),
+	int_fold<std::not_equal_to<int64_t>>("!="),
+	int_fold<std::less<int64_t>>("<"),
+	int_fold<std::less_equal<int64_t>>("<="),
+	int_fold<std::greater<int64_t>>(">"),
+	int_fold<std::greater_equal<int64_t>>(">="),
+};
+
+// Returns intrinsic that symbol refers to in current scope
+static Value const* intrinsic(Context &ctx, Value const& expr)
+{
+	if (expr.type != Value::Type::Symbol)
+		return nullptr;
+	auto const value = ctx[expr];
+	return value && value->type == Value::Type::Cpp_Function ? value : nullptr;
+}
+
+// Intrinsics are plain functions, so ones that differ only in operation are instantiated for each
+template<auto Op>
+static Value math(Context &ctx, Value const& args)
+{
+	assert(args.list().size() >= 1);
+	auto result = eval(ctx, args.at(0));
+	for (auto const& val : args.tail()) { (result.*Op)(eval(ctx, val)); }
+	return result;
+}
+
+template<auto Op>
+static Value equality(Context &ctx, Value const& args)
+{
+	assert(args.list().size() >= 1);
+	auto prev = eval(ctx, args.at(0));
+	for (auto const& val : args.tail()) {
+		auto curr = eval(ctx, val);
+		if (!(prev.*Op)(curr)) {
+			return Value::integer(false);
+		}
 	}
+	return Value::integer(true);
+}
 
+template<typename Compare>
+static Value comparison(Context &ctx, Value const& args)
+{
+	assert(args.list().size() >= 1);
+	auto prev = eval(ctx, args.at(0));
+	for (auto const& val : args.tail()) {
+		auto curr = eval(ctx, val);
+		if (!Compare{}(prev.ival, curr.ival))
+			return Value::integer(false);
+		prev = curr;
+	}
+	return Value::integer(true);
+}
 
-	ctx.define("do") = [](auto& ctx, Value args) {
-		assert(args.list.size() >= 1);
-		for (auto val : args.init()) eval(ctx, std::move(val));
-		return eval(ctx, args.list.back());
+// Parallel counterparts of for, fold and zip-with. Elements of sequence are pulled
+// first, then operation is applied to them on thread pool
+template<auto Op>
+static Value parallel(Context &ctx, Value const& args)
+{
+	assert(args.list().size() == 2);
+	std::vector<Value> elements;
+	for_each(ctx, eval(ctx, args.at(1)), [&](Value el) { elements.push_back(std::move(el)); });
+	return Op(ctx, args.at(0), elements);
+}
+
+// Wraps user function, so it is evaluated once for each list of arguments
+static Value memoize(Value function, std::size_t capacity)
+{
+	if (function.type == Value::Type::Memo_Function)
+		return function;
+	if (function.type != Value::Type::List || function.list().size() != 2 || function.list().front().type != Value::Type::List)
+		error_fatal("memo expects user function");
+
+	Value memo(Value::Type::Memo_Function);
+	memo.memo_function().function = std::move(function);
+	memo.memo_function().capacity = capacity;
+	return memo;
+}
+
+void intrinsics(Context &ctx)
+{
+	// Operations that zip-with applies to int vectors element-wise
+	static constexpr auto Math_Operations = std::array {
+		std::tuple { "+", &Value::operator+= },
+		std::tuple { "-", &Value::operator-= },
+		std::tuple { "*", &Value::operator*= }
+	};
+
+	// TODO division, modulo
+	ctx.define("+") = math<&Value::operator+=>;
+	ctx.define("-") = math<&Value::operator-=>;
+	ctx.define("*") = math<&Value::operator*=>;
+
+	ctx.define("==") = equality<&Value::operator==>;
+	ctx.define("!=") = equality<&Value::operator!=>;
+
+	ctx.define("<")  = comparison<std::less<int64_t>>;
+	ctx.define("<=") = comparison<std::less_equal<int64_t>>;
+	ctx.define(">")  = comparison<std::greater<int64_t>>;
+	ctx.define(">=") = comparison<std::greater_equal<int64_t>>;
+
+	ctx.define("do") = [](auto& ctx, Value const& args) {
+		assert(args.list().size() >= 1);
+		for (auto const& val : args.init()) eval(ctx, val);
+		return eval(ctx, args.list().back());
 	};
 
-	ctx.define("def") = [](auto& ctx, Value args) {
-		assert(args.list.size() >= 2);
+	ctx.define("def") = [](auto& ctx, Value const& args) {
+		assert(args.list().size() >= 2);
 		assert(args.type == Value::Type::List);
-		assert(args.list.front().type == Value::Type::Symbol);
-		ctx.assign(args.list.front().sval, eval(ctx, std::move(*std::next(args.list.begin()))));
+		assert(args.at(0).type == Value::Type::Symbol);
+		ctx.assign(args.at(0).symbol_id(), eval(ctx, args.at(1)));
 		return Value::nil();
 	};
 
-	ctx.define("print") = [](auto& ctx, Value args) {
-		for (auto& arg : args.list)
-			arg = eval(ctx, std::move(arg));
+	ctx.define("print") = [](auto& ctx, Value const& args) {
+		// Every argument is evaluated before any is written, since they may print too
+		Value::List values;
+		for (auto const& arg : args.list())
+			values.push_back(eval(ctx, arg));
+
+		fmt::format_to(fmt::appender(output_buffer()), "{}\n", fmt::join(std::as_const(values), ""));
+		output_written();
+		return Value::nil();
+	};
 
-		fmt::print("{}\n", fmt::join(args.list, ""));
+	ctx.define("flush") = [](auto&, Value const&) {
+		flush_output();
 		return Value::nil();
 	};
 
-	ctx.define("fun") = [](auto&, Value args) { return args; };
-	ctx.define("list") = [](auto&, Value args) { return args; };
+	ctx.define("fun") = [](auto& ctx, Value const& args) {
+		auto function = args;
+		resolve_function(ctx, function);
+		return function;
+	};
+	ctx.define("list") = [](auto&, Value const& args) { return args; };
+
+	ctx.define("memo") = [](Context &ctx, Value const& args) {
+		assert(args.list().size() >= 1);
+		auto capacity = memo_limit;
+		if (args.list().size() > 1) {
+			auto count = eval(ctx, args.at(1));
+			assert(count.type == Value::Type::Int && count.ival >= 0);
+			capacity = count.ival;
+		}
+		return memoize(eval(ctx, args.at(0)), capacity);
+	};
 
-	ctx.define("if") = [](auto& ctx, Value args) {
-		assert(args.list.size() >= 2);
+	// (defmemo name (params...) body) is (def name (memo (fun (params...) body)))
+	ctx.define("defmemo") = [](Context &ctx, Value const& args) {
+		assert(args.list().size() >= 3);
+		assert(args.at(0).type == Value::Type::Symbol);
+		Value function(Value::List { args.at(1), args.at(2) });
+		resolve_function(ctx, function);
+		ctx.assign(args.at(0).symbol_id(), memoize(std::move(function), memo_limit));
+		return Value::nil();
+	};
+
+	ctx.define("if") = [](auto& ctx, Value const& args) {
+		assert(args.list().size() >= 2);
 		auto condition = eval(ctx, args.at(0));
 		if (condition.coarce_bool())
 			return eval(ctx, args.at(1));
-		if (args.list.size() > 2)
+		if (args.list().size() > 2)
 			return eval(ctx, args.at(2));
 		return Value::nil();
 	};
 
 	// TODO alias to concat
 	// TODO sequences concatenation (++ (seq 0 1) (seq 0 2)) == (seq 0 1 0 2)
-	ctx.define("++") = [](auto& ctx, Value args) {
-		Value list;
-		list.type = Value::Type::List;
-		for (auto arg : args.list) {
-			Value v = eval(ctx, std::move(arg));
+	ctx.define("++") = [](auto& ctx, Value const& args) {
+		Value list(Value::Type::List);
+		for (auto const& arg : args.list()) {
+			Value v = eval(ctx, arg);
 			switch (v.type) {
 			case Value::Type::Nil:
 				continue;
 
 			case Value::Type::List:
-				if (v.list.empty())
-					continue;
-				for (auto e : std::move(v.list)) {
-					list.list.push_back(std::move(e));
-				}
+			case Value::Type::Int_Vector:
+				list.mutable_list().append(v.as_list().list());
 				break;
 			default:
-				list.list.push_back(std::move(v));
+				list.mutable_list().push_back(std::move(v));
 			}
 		}
 		return list;
@@ -126,25 +320,27 @@ void intrinsics(Context &ctx)
 
 
 	// TODO unify with Value::size()
-	ctx.define("len") = [](Context &ctx, Value args) {
-		assert(args.list.size() >= 1);
+	ctx.define("len") = [](Context &ctx, Value const& args) {
+		assert(args.list().size() >= 1);
 		auto collection = eval(ctx, args.at(0));
 
 		switch (collection.type) {
 		case Value::Type::List:
-			return Value::integer(collection.list.size());
+			return Value::integer(collection.list().size());
+		case Value::Type::Int_Vector:
+			return Value::integer(collection.ints().size());
 		case Value::Type::Sequence:
-			return collection.sequence->len(ctx);
+			return collection.sequence()->len(ctx);
 		case Value::Type::String:
-			return Value::integer(collection.sval.size());
+			return Value::integer(collection.sval().size());
 		default:
 			error_fatal("len is supported only for strings, sequences and lists");
 		}
 	};
 
 	// TODO unify with Value::index()
-	ctx.define("index") = [](Context &ctx, Value args) {
-		assert(args.list.size() >= 2);
+	ctx.define("index") = [](Context &ctx, Value const& args) {
+		assert(args.list().size() >= 2);
 		auto index = eval(ctx, args.at(0));
 		auto collection = eval(ctx, args.at(1));
 		assert(index.type == Value::Type::Int);
@@ -152,35 +348,36 @@ void intrinsics(Context &ctx)
 		switch (collection.type) {
 		case Value::Type::List:
 			return collection.at(index.ival);
+		case Value::Type::Int_Vector:
+			return collection.index(ctx, index.ival);
 		case Value::Type::Sequence:
-			return collection.sequence->index(ctx, index.ival);
+			return collection.sequence()->index(ctx, index.ival);
 		case Value::Type::String:
-			return Value::integer(collection.sval[index.ival]);
+			return Value::integer(collection.sval()[index.ival]);
 		default:
 			error_fatal("index is supported only for strings, sequences and lists");
 		}
 	};
 
-	// TODO support for sequences
-	ctx.define("for") = [](Context &ctx, Value args) {
-		assert(args.list.size() >= 3);
+	ctx.define("for") = [](Context &ctx, Value const& args) {
+		assert(args.list().size() >= 3);
 		auto collection = eval(ctx, args.at(1));
-		assert(collection.type == Value::Type::List);
-		for (auto arg : collection.list) {
+		for_each(ctx, collection, [&](Value arg) {
 			auto local_scope_guard = ctx.local_scope();
 
 			switch (args.at(0).type) {
 			case Value::Type::Symbol:
-				ctx.assign(args.at(0).sval, eval(ctx, arg));
+				ctx.assign(args.at(0).symbol_id(), eval(ctx, arg));
 				break;
 
 			case Value::Type::List:
 				{
+					auto const elements = arg.as_list();
 					unsigned i = 0;
-					for (auto const& name : args.at(0).list) {
+					for (auto const& name : args.at(0).list()) {
 						assert(name.type == Value::Type::Symbol);
-						assert(i < arg.list.size());
-						ctx.assign(name.sval, eval(ctx, std::move(arg.at(i++))));
+						assert(i < elements.list().size());
+						ctx.assign(name.symbol_id(), eval(ctx, elements.at(i++)));
 					}
 				}
 				break;
@@ -189,98 +386,103 @@ void intrinsics(Context &ctx)
 				assert(false && "wrong type");
 			}
 			eval(ctx, args.at(2));
-		}
+		});
 
 		return Value::nil();
 	};
 
 	// TODO support for sequences, strings
-	ctx.define("zip") = [](auto& ctx, Value args) {
-		std::vector<decltype(args.list)> lists;
-		std::vector<decltype(args.list.begin())> iters;
-		for (auto arg : args.list) {
-			auto list = eval(ctx, std::move(arg));
+	ctx.define("zip") = [](auto& ctx, Value const& args) {
+		std::vector<Value::List> lists;
+		std::vector<Value::List::const_iterator> iters;
+		for (auto const& arg : args.list()) {
+			auto list = eval(ctx, arg).as_list();
 			assert(list.type == Value::Type::List);
-			auto &ref = lists.emplace_back(list.list);
+			auto const& ref = lists.emplace_back(list.list());
 			iters.emplace_back(ref.begin());
 		}
 
-		Value result;
-		result.type = Value::Type::List;
+		Value result(Value::Type::List);
 		for (;;) {
-			if (!std::ranges::all_of(iters, [lists = lists.begin()](auto it) mutable { return lists++->end() != it; }))
+			if (!std::ranges::all_of(iters, [lists = lists.cbegin()](auto it) mutable { return lists++->end() != it; }))
 				break;
 
-			auto &list = result.list.emplace_back();
-			list.type = Value::Type::List;
+			auto &list = result.mutable_list().emplace_back(Value::Type::List);
 			for (auto &it : iters) {
-				list.list.push_back(std::move(*it++));
+				list.mutable_list().push_back(*it++);
 			}
 		}
 
 		return result;
 	};
 
-	// TODO ziping sequences does not work (Check examples/sequences.patty)
-	ctx.define("zip-with") = [](auto& ctx, Value args) {
+	ctx.define("zip-with") = [](auto& ctx, Value const& args) {
 		std::vector<Value> collections;
 		std::vector<unsigned> indexes;
 		auto op = args.at(0);
 
 		bool contains_sequence = false;
-		for (auto arg : args.tail()) {
-			auto collection = eval(ctx, std::move(arg));
+		for (auto const& arg : args.tail()) {
+			auto collection = eval(ctx, arg);
 			if (collection.type == Value::Type::Sequence)
 				contains_sequence = true;
 			collections.emplace_back(std::move(collection));
 			indexes.emplace_back(0);
 		}
 
+		// Arithmetic on int vectors is done element-wise, without evaluating call for each element
+		if (auto intrinsic_op = intrinsic(ctx, op); intrinsic_op && !collections.empty()
+				&& std::ranges::all_of(collections, [](Value const& c) { return c.type == Value::Type::Int_Vector; })) {
+			for (auto [name, operation] : Math_Operations) {
+				if (intrinsic_op->sval() != name)
+					continue;
+				auto result = collections.front();
+				for (auto const& collection : collections | std::views::drop(1))
+					(result.*operation)(collection);
+				return result;
+			}
+		}
+
 		if (contains_sequence) {
 			auto zip = std::make_shared<Zip_Sequence>();
 
 			zip->zipper = [op = args.at(0)](Context &ctx, Value args) {
-				args.list.push_front(op);
+				args.mutable_list().push_front(op);
 				return eval(ctx, args);
 			};
 
-			for (auto arg : args.tail()) {
+			for (auto const& arg : collections) {
 				if (arg.type == Value::Type::Sequence) {
-					zip->children.push_back(std::move(arg.sequence));
+					zip->children.push_back(arg.sequence());
 				} else {
 					Value_Sequence vs;
 					vs.expr = arg;
 					zip->children.push_back(std::make_shared<Value_Sequence>(std::move(vs)));
 				}
 			}
-			Value zipped;
-			zipped.type = Value::Type::Sequence;
-			zipped.sequence = std::move(zip);
-			return zipped;
+			return Value(std::move(zip));
 		}
 
-		Value result;
-		result.type = Value::Type::List;
+		Value result(Value::Type::List);
 
 		for (;;) {
 			if (!std::ranges::all_of(indexes, [c = collections.begin(), &ctx](auto it) mutable { return it < c++->size(ctx); }))
 				break;
 
-			Value call;
-			call.type = Value::Type::List;
-			call.list.push_front(args.at(0));
+			Value call(Value::Type::List);
+			call.mutable_list().push_front(args.at(0));
 			unsigned i = 0;
 			for (auto &idx : indexes) {
-				call.list.push_back(collections[i++].index(ctx, idx++));
+				call.mutable_list().push_back(collections[i++].index(ctx, idx++));
 			}
 
-			result.list.emplace_back(eval(ctx, call));
+			result.mutable_list().emplace_back(eval(ctx, call));
 		}
 
-		return Value::nil();
+		return result;
 	};
 
-	ctx.define("take") = [](auto &ctx, Value args) {
+	ctx.define("take") = [](auto &ctx, Value const& args) {
 		Value count = eval(ctx, args.at(0));
 		Value from = eval(ctx, args.at(1));
 		assert(count.type == Value::Type::Int);
@@ -288,36 +490,100 @@ void intrinsics(Context &ctx)
 		return from.take(ctx, count.ival);
 	};
 
+	ctx.define("ptake") = [](Context &ctx, Value const& args) {
+		Value count = eval(ctx, args.at(0));
+		Value from = eval(ctx, args.at(1));
+		assert(count.type == Value::Type::Int);
+		assert(count.ival >= 0);
+		if (from.type != Value::Type::Sequence)
+			return from.take(ctx, count.ival);
+		return parallel_take(ctx, *from.sequence(), count.ival);
+	};
+
 	// TODO support for sequences
 	// TODO unification with Value::tail
-	ctx.define("tail") = [](auto &ctx, Value args) {
-		Value tail;
-		tail.type = Value::Type::List;
-		auto source = eval(ctx, args.at(0));
-		tail.list.assign(std::next(source.list.begin()), source.list.end());
+	ctx.define("tail") = [](auto &ctx, Value const& args) {
+		auto tail = eval(ctx, args.at(0));
+		auto &list = tail.mutable_list();
+		assert(!list.empty());
+		list.pop_front();
 		return tail;
 	};
 
-	// TODO support for sequences
 	// TODO support for strings
-	ctx.define("fold") = [](auto &ctx, Value args) {
-		Value collection = eval(ctx, args.at(1));
-
-		Value invoke;
-		invoke.type = Value::Type::List;
-		invoke.list.push_back(args.at(0));
-		invoke.list.push_back(collection.at(0));
-		for (auto el : collection.tail()) {
-			invoke.list.push_back(std::move(el));
-			invoke.at(1) = eval(ctx, invoke);
-			invoke.list.pop_back();
+	ctx.define("fold") = [](Context &ctx, Value const& args) {
+		decltype(&fold_ints<std::plus<int64_t>, Value>) kernel = nullptr;
+		decltype(&fold_ints<std::plus<int64_t>, int64_t>) ints_kernel = nullptr;
+		if (auto op = intrinsic(ctx, args.at(0))) {
+			for (auto [name, values, ints] : Int_Folds) {
+				if (op->sval() == name) {
+					kernel = values;
+					ints_kernel = ints;
+				}
+			}
+		}
+
+		// (fold op (take n seq)) folds prefix of sequence without taking it into list first
+		Value collection;
+		auto limit = std::numeric_limits<std::size_t>::max();
+		auto const& arg = std::as_const(args).at(1);
+		auto const take = arg.type == Value::Type::List && !arg.list().empty() ? intrinsic(ctx, arg.list().front()) : nullptr;
+		if (take && take->sval() == "take") {
+			Value count = eval(ctx, arg.at(1));
+			assert(count.type == Value::Type::Int);
+			assert(count.ival >= 0);
+			collection = eval(ctx, arg.at(2));
+			if (collection.type == Value::Type::Sequence)
+				limit = count.ival;
+			else
+				collection = collection.take(ctx, count.ival);
+		} else {
+			collection = eval(ctx, arg);
+		}
+
+		if (ints_kernel && collection.type == Value::Type::Int_Vector) {
+			auto const& ints = collection.ints();
+			if (ints.empty())
+				return Value::nil();
+			return Value::integer(ints_kernel(ints.front(), std::span(ints).subspan(1)));
 		}
-		return invoke.at(1);
+
+		Value invoke(Value::Type::List);
+		invoke.mutable_list().push_back(args.at(0));
+		bool first = true;
+		for_each_chunk(ctx, collection, limit, [&](std::span<Value const> chunk) {
+			if (chunk.empty())
+				return;
+			if (std::exchange(first, false)) {
+				invoke.mutable_list().push_back(chunk.front());
+				chunk = chunk.subspan(1);
+			}
+
+			while (!chunk.empty()) {
+				if (auto &acc = invoke.at(1); kernel && acc.type == Value::Type::Int) {
+					auto const ints = std::ranges::find_if(chunk, [](Value const& el) { return el.type != Value::Type::Int; });
+					acc.ival = kernel(acc.ival, std::span(chunk.begin(), ints));
+					chunk = std::span(ints, chunk.end());
+					if (chunk.empty())
+						break;
+				}
+
+				invoke.mutable_list().push_back(chunk.front());
+				invoke.at(1) = eval(ctx, invoke);
+				invoke.mutable_list().pop_back();
+				chunk = chunk.subspan(1);
+			}
+		});
+		return first ? Value::nil() : invoke.at(1);
 	};
 
-	ctx.define("loop") = [](auto &ctx, Value args) {
+	ctx.define("pmap")    = parallel<&parallel_map>;
+	ctx.define("pfilter") = parallel<&parallel_filter>;
+	ctx.define("preduce") = parallel<&parallel_reduce>;
+
+	ctx.define("loop") = [](auto &ctx, Value const& args) {
 		for (;;) {
-			for (auto arg : args.list)
+			for (auto const& arg : args.list())
 				eval(ctx, arg);
 		}
 		return Value::nil();
@@ -325,62 +591,48 @@ void intrinsics(Context &ctx)
 
 	// TODO support for all data types
 	// TODO (read value) for parsing s-expressions in string `value`
-	ctx.define("read") = [](auto &, Value args) {
+	ctx.define("read") = [](Context &ctx, Value const& args) {
 		assert(args.at(0).type == Value::Type::Symbol);
 
-		if (args.at(0).sval == "int") {
-			Value result = Value::integer(0);
-			std::cin >> result.ival;
-			return result;
-		}
+		// Prompts printed so far are shown before waiting for input
+		flush_output();
 
-		assert(false && "unimplemented");
-	};
+		if (args.at(0).sval() == "int") {
+			std::vector<int64_t> ints;
+			return Value::integer(read_ints(ints, 1) ? ints.front() : 0);
+		}
 
+		// All remaining integers or at most given number of them
+		if (args.at(0).sval() == "ints") {
+			auto limit = std::numeric_limits<std::size_t>::max();
+			if (args.list().size() > 1) {
+				auto count = eval(ctx, args.at(1));
+				assert(count.type == Value::Type::Int && count.ival >= 0);
+				limit = count.ival;
+			}
+			std::vector<int64_t> ints;
+			read_ints(ints, limit);
+			return Value::int_vector(std::move(ints));
+		}
 
-	ctx.define("seq") = [](auto &ctx, Value args) {
-		Value seq;
-		seq.type = Value::Type::Sequence;
+		if (args.at(0).sval() == "seq")
+			return Value(std::make_shared<Input_Sequence>());
 
-		if (args.is_static_expression(ctx)) {
-			auto gen = std::make_shared<Circular_Generator>();
-			gen->value_set = std::move(args);
-			seq.sequence = std::move(gen);
-		} else {
-			auto end_of_statics = std::find_if(args.list.begin(), args.list.end(), [&ctx](auto &val) {
-				return !val.is_static_expression(ctx);
-			});
-
-			if (end_of_statics == args.list.begin()) {
-				auto gen = std::make_shared<Dynamic_Generator>();
-				gen->expr = std::move(args.at(0));
-				seq.sequence = std::move(gen);
-			} else {
-				auto composed = std::make_shared<Composed_Generator>();
-
-				auto circular = std::make_shared<Circular_Generator>();
-				for (auto statics = args.list.begin(); statics != end_of_statics; ++statics) {
-					circular->value_set.list.push_back(std::move(*statics));
-				}
-				composed->children.push_back(std::move(circular));
+		assert(false && "unimplemented");
+	};
 
-				auto dynamic = std::make_shared<Dynamic_Generator>();
-				dynamic->expr = std::move(*end_of_statics);
-				composed->children.push_back(std::move(dynamic));
 
-				seq.sequence = std::move(composed);
-			}
-		}
-		return seq;
-	};
+	ctx.define("seq") = [](auto &ctx, Value const& args) { return sequence(ctx, args, false); };
+	ctx.define("seq-memo") = [](auto &ctx, Value const& args) { return sequence(ctx, args, true); };
 
-	ctx.define("seq!") = [](auto &ctx, Value args) {
-		args.subst(ctx);
-		return ctx.scopes.front()["seq"].cpp_function(ctx, args);
+	ctx.define("seq!") = [](auto &ctx, Value const& args) {
+		auto substituted = args;
+		substituted.subst(ctx);
+		return sequence(ctx, std::move(substituted), false);
 	};
 
 	// TODO string support
-	ctx.define("pop") = [](Context &ctx, Value args)
+	ctx.define("pop") = [](Context &ctx, Value const& args)
 	{
 		auto count = eval(ctx, args.at(0));
 		auto collection = eval(ctx, args.at(1));
@@ -388,13 +640,12 @@ void intrinsics(Context &ctx)
 
 		switch (collection.type) {
 		case Value::Type::Sequence:
-			return collection.sequence->pop(ctx, count.ival);
+			return collection.sequence()->pop(ctx, count.ival);
 		case Value::Type::List:
+		case Value::Type::Int_Vector:
 			{
-				auto to_pop = std::min((uint64_t)count.ival, collection.list.size());
-				for (auto i = 0u; i < to_pop; ++i) {
-					collection.list.pop_front();
-				}
+				auto &list = collection.mutable_list();
+				list.drop_front(std::min((uint64_t)count.ival, list.size()));
 				return collection;
 			}
 
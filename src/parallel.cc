@@ -0,0 +1,394 @@
+#include "patty.hh"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+unsigned thread_count = 0;
+
+// Set while worker threads evaluate. State shared between them is then only read:
+// memo buffers are not filled and shared list storage is not grown in place
+bool parallel_section = false;
+
+// Worker threads are started on first use. Main thread works as worker 0.
+// Indices are split into one contiguous range per worker, each worker takes blocks
+// from the front of its own range and when it runs out, steals back half of the
+// largest range left
+struct Thread_Pool
+{
+	using Task = std::function<void(unsigned worker, std::size_t begin, std::size_t end)>;
+
+	struct Range
+	{
+		std::mutex mutex;
+		std::size_t begin = 0, end = 0;
+	};
+
+	std::vector<Range> ranges;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	unsigned generation = 0, running = 0;
+
+	Task const* task = nullptr;
+	std::size_t block = 0;
+
+	explicit Thread_Pool(unsigned size)
+		: ranges(size)
+	{
+		for (auto worker = 1u; worker < size; ++worker)
+			std::thread([this, worker] { work(worker); }).detach();
+	}
+
+	unsigned size() const { return ranges.size(); }
+
+	[[noreturn]] void work(unsigned worker)
+	{
+		for (unsigned seen = 0;;) {
+			{
+				std::unique_lock lock(mutex);
+				wake.wait(lock, [&] { return generation != seen; });
+				seen = generation;
+			}
+
+			process(worker);
+
+			std::lock_guard lock(mutex);
+			if (--running == 0)
+				done.notify_one();
+		}
+	}
+
+	void process(unsigned worker)
+	{
+		auto &own = ranges[worker];
+		for (;;) {
+			std::size_t begin, end;
+			{
+				std::lock_guard lock(own.mutex);
+				begin = own.begin;
+				end = own.begin = std::min(own.begin + block, own.end);
+			}
+
+			if (begin == end) {
+				if (!steal(worker))
+					return;
+				continue;
+			}
+
+			(*task)(worker, begin, end);
+		}
+	}
+
+	// Moves back half of the largest range of other worker into range of this one
+	bool steal(unsigned worker)
+	{
+		for (;;) {
+			auto victim = size();
+			std::size_t largest = 0;
+			for (auto other = 0u; other < size(); ++other) {
+				if (other == worker) continue;
+				std::lock_guard lock(ranges[other].mutex);
+				if (auto const left = ranges[other].end - ranges[other].begin; left > largest) {
+					largest = left;
+					victim = other;
+				}
+			}
+			if (victim == size())
+				return false;
+
+			std::size_t begin, end;
+			{
+				std::lock_guard lock(ranges[victim].mutex);
+				auto &range = ranges[victim];
+				if (range.begin == range.end)
+					continue;
+				end = range.end;
+				begin = range.end = range.end - (range.end - range.begin + 1) / 2;
+			}
+
+			std::lock_guard lock(ranges[worker].mutex);
+			ranges[worker].begin = begin;
+			ranges[worker].end = end;
+			return true;
+		}
+	}
+
+	void run(std::size_t count, Task const& task)
+	{
+		{
+			std::lock_guard lock(mutex);
+			this->task = &task;
+			// Several blocks per thread, so threads that got cheaper elements help others
+			block = std::max<std::size_t>(1, count / (size() * 8));
+			for (auto worker = 0u; worker < size(); ++worker) {
+				std::lock_guard range_lock(ranges[worker].mutex);
+				ranges[worker].begin = count * worker / size();
+				ranges[worker].end = count * (worker + 1) / size();
+			}
+			running = size() - 1;
+			++generation;
+		}
+		wake.notify_all();
+
+		process(0);
+
+		std::unique_lock lock(mutex);
+		done.wait(lock, [&] { return running == 0; });
+	}
+};
+
+static Thread_Pool& thread_pool()
+{
+	// Never destroyed: error_fatal may exit from worker thread, which cannot join itself
+	static auto &pool = *new Thread_Pool(thread_count ? thread_count : std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
+// Context in which worker thread evaluates. It is kept between parallel calls, so only
+// globals defined since previous call are copied, not the whole table
+struct Worker_Context
+{
+	Context ctx;
+	std::size_t globals = 0; // number of globals copied from parent
+	std::uint64_t epoch = 0; // epoch of parent when they were copied
+
+	// Makes globals and scopes of parent visible, so worker can evaluate on its behalf.
+	// Globals are only appended or defined once, so older ones stay valid
+	void mirror(Context const& parent)
+	{
+		// Slots reserved by worker itself may be used by parent for other names
+		if (ctx.globals.size() != globals) {
+			ctx.globals.resize(globals);
+			epoch = 0;
+		}
+
+		if (epoch != parent.epoch || globals != parent.globals.size()) {
+			for (std::size_t slot = 0; slot < globals; ++slot) {
+				if (auto &global = ctx.globals[slot]; !global.defined && parent.globals[slot].defined) {
+					global.value = parent.globals[slot].value;
+					global.defined = true;
+				}
+			}
+			for (auto slot = globals; slot < parent.globals.size(); ++slot) {
+				auto const& global = parent.globals[slot];
+				ctx.globals.push_back(Context::Global{ .name = global.name, .value = global.value, .defined = global.defined, .shadowed = 0 });
+			}
+			ctx.global_slots = parent.global_slots;
+			ctx.epoch = epoch = parent.epoch;
+			globals = parent.globals.size();
+		}
+
+		for (auto const& scope : parent.scopes) {
+			auto &copy = ctx.push_scope();
+			copy.names = scope.names;
+			copy.values = scope.values;
+			copy.shadowed = scope.shadowed;
+			for (auto slot : copy.shadowed)
+				++ctx.globals[slot].shadowed;
+		}
+	}
+
+	// Local values are released, so they don't outlive parallel call
+	void release()
+	{
+		while (!ctx.scopes.empty())
+			ctx.pop_scope();
+	}
+};
+
+void parallel_for(Context &ctx, std::size_t count, std::function<void(Context&, std::size_t)> const& task)
+{
+	// Nested parallel calls are evaluated by thread that made them
+	if (parallel_section) {
+		for (std::size_t i = 0; i < count; ++i)
+			task(ctx, i);
+		return;
+	}
+
+	auto &pool = thread_pool();
+
+	// Main thread evaluates in ctx itself, other workers in their own mirror of it,
+	// so each can push frames independently. Never destroyed, like thread pool
+	static auto &workers = *new std::vector<Worker_Context>(pool.size() - 1);
+	for (auto &worker : workers)
+		worker.mirror(ctx);
+
+	parallel_section = true;
+	Value::List::grow_shared = false;
+	pool.run(count, [&](unsigned worker, std::size_t begin, std::size_t end) {
+		auto &worker_ctx = worker == 0 ? ctx : workers[worker - 1].ctx;
+		for (auto i = begin; i < end; ++i)
+			task(worker_ctx, i);
+	});
+	Value::List::grow_shared = true;
+	parallel_section = false;
+
+	for (auto &worker : workers)
+		worker.release();
+}
+
+// Finds name of intrinsic with side effects that could be called when evaluating expr,
+// following user functions and sequences it refers to
+static std::optional<std::string> find_impure(Context &ctx, Value const& expr, std::unordered_set<void const*> &visited)
+{
+	static constexpr auto Impure = std::array { "print"sv, "flush"sv, "read"sv, "def"sv, "defmemo"sv };
+
+	auto const find_in = [&](Value const& value) -> std::optional<std::string> {
+		switch (value.type) {
+		case Value::Type::Cpp_Function:
+			if (std::find(R(Impure), value.sval()) != Impure.end())
+				return value.sval();
+			return std::nullopt;
+
+		case Value::Type::List:
+			// User function
+			if (value.list().size() == 2 && visited.insert(value.list().begin()).second)
+				return find_impure(ctx, value.at(1), visited);
+			return std::nullopt;
+
+		case Value::Type::Memo_Function:
+			if (auto const& function = value.memo_function().function; visited.insert(function.list().begin()).second)
+				return find_impure(ctx, function.at(1), visited);
+			return std::nullopt;
+
+		case Value::Type::Sequence:
+			if (auto seq = value.sequence().get(); visited.insert(seq).second) {
+				if (auto dynamic = dynamic_cast<Dynamic_Generator const*>(seq))
+					return find_impure(ctx, dynamic->expr, visited);
+				if (auto circular = dynamic_cast<Circular_Generator const*>(seq))
+					return find_impure(ctx, circular->value_set, visited);
+				if (auto composed = dynamic_cast<Composed_Generator const*>(seq)) {
+					for (auto const& child : composed->children)
+						if (auto name = find_impure(ctx, Value(child), visited))
+							return name;
+				}
+				if (auto recurrence = dynamic_cast<Recurrence_Generator const*>(seq))
+					return find_impure(ctx, Value(recurrence->general), visited);
+			}
+			return std::nullopt;
+
+		default:
+			return std::nullopt;
+		}
+	};
+
+	switch (expr.type) {
+	case Value::Type::Symbol:
+		if (auto resolved = ctx[expr])
+			return find_in(*resolved);
+		return std::nullopt;
+
+	case Value::Type::List:
+		for (auto const& el : expr.list())
+			if (auto name = find_impure(ctx, el, visited))
+				return name;
+		return std::nullopt;
+
+	default:
+		return find_in(expr);
+	}
+}
+
+void require_pure(Context &ctx, Value const& expr, std::string_view name)
+{
+	std::unordered_set<void const*> visited;
+	if (auto impure = find_impure(ctx, expr, visited))
+		error_fatal("{} requires function without side effects, but it calls {}"_format(name, *impure));
+}
+
+Value parallel_take(Context &ctx, Sequence &seq, std::size_t n)
+{
+	auto const dynamic = dynamic_cast<Dynamic_Generator*>(&seq);
+	if (!dynamic || parallel_section)
+		return Sequence::take(seq, ctx, n);
+
+	require_pure(ctx, dynamic->expr, "ptake");
+
+	std::vector<Value> elements(n);
+	parallel_for(ctx, n, [&](Context &ctx, std::size_t i) {
+		elements[i] = dynamic->index(ctx, i);
+	});
+
+	// Integers are stored unboxed, like result of take
+	if (!elements.empty() && std::ranges::all_of(elements, [](Value const& el) { return el.type == Value::Type::Int; })) {
+		std::vector<int64_t> ints;
+		ints.reserve(elements.size());
+		for (auto const& el : elements)
+			ints.push_back(el.ival);
+		return Value::int_vector(std::move(ints));
+	}
+	return Value(Value::List(std::make_move_iterator(elements.begin()), std::make_move_iterator(elements.end())));
+}
+
+// Evaluates (op arg...) in given context
+static Value apply(Context &ctx, Value const& op, auto const& ...args)
+{
+	return eval(ctx, Value(Value::List { op, args... }));
+}
+
+Value parallel_map(Context &ctx, Value const& op, std::vector<Value> const& elements)
+{
+	require_pure(ctx, op, "pmap");
+
+	std::vector<Value> results(elements.size());
+	parallel_for(ctx, elements.size(), [&](Context &ctx, std::size_t i) {
+		results[i] = apply(ctx, op, elements[i]);
+	});
+	return Value(Value::List(std::make_move_iterator(results.begin()), std::make_move_iterator(results.end())));
+}
+
+Value parallel_filter(Context &ctx, Value const& op, std::vector<Value> const& elements)
+{
+	require_pure(ctx, op, "pfilter");
+
+	// Not std::vector<bool>, since threads write neighbouring elements
+	std::vector<char> keep(elements.size());
+	parallel_for(ctx, elements.size(), [&](Context &ctx, std::size_t i) {
+		keep[i] = apply(ctx, op, elements[i]).coarce_bool();
+	});
+
+	Value result(Value::Type::List);
+	for (std::size_t i = 0; i < elements.size(); ++i)
+		if (keep[i])
+			result.mutable_list().push_back(elements[i]);
+	return result;
+}
+
+// Builtin operators that give different result when partial results are combined in a tree
+static constexpr auto Non_Associative = std::array { "-"sv, "=="sv, "!="sv, "<"sv, "<="sv, ">"sv, ">="sv };
+
+Value parallel_reduce(Context &ctx, Value const& op, std::vector<Value> const& elements)
+{
+	require_pure(ctx, op, "preduce");
+
+	auto const callee = op.type == Value::Type::Symbol ? ctx[op] : &op;
+	if (callee && callee->type == Value::Type::Cpp_Function
+			&& std::find(R(Non_Associative), callee->sval()) != Non_Associative.end())
+		error_fatal("preduce requires associative function, but {} is not; use fold instead"_format(callee->sval()));
+
+	if (elements.empty())
+		return Value::nil();
+
+	// Leaves reduce contiguous parts left to right, then neighbouring partial results
+	// are combined pairwise level by level. Order of operands is kept, so op must
+	// only be associative
+	auto const leaves = std::min(elements.size(), std::size_t(thread_pool().size()) * 8);
+	std::vector<Value> partial(leaves);
+	parallel_for(ctx, leaves, [&](Context &ctx, std::size_t leaf) {
+		auto const begin = elements.size() * leaf / leaves, end = elements.size() * (leaf + 1) / leaves;
+		Value acc = elements[begin];
+		for (auto i = begin + 1; i < end; ++i)
+			acc = apply(ctx, op, acc, elements[i]);
+		partial[leaf] = std::move(acc);
+	});
+
+	for (std::size_t width = 1; width < leaves; width *= 2) {
+		parallel_for(ctx, (leaves + 2 * width - 1) / (2 * width), [&](Context &ctx, std::size_t pair) {
+			auto const left = pair * 2 * width, right = left + width;
+			if (right < leaves)
+				partial[left] = apply(ctx, op, partial[left], partial[right]);
+		});
+	}
+	return partial[0];
+}
@@ -1,6 +1,11 @@
 #include "patty.hh"
+#include <charconv>
 #include <iostream>
-#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 using namespace std::string_view_literals;
@@ -8,6 +13,13 @@ using namespace fmt::literals;
 
 fs::path program_name;
 fs::path filename;
+std::size_t memo_limit = 1 << 20;
+
+enum class Engine
+{
+	Tree,
+	Vm
+} engine = Engine::Tree;
 
 namespace version
 {
@@ -26,11 +38,18 @@ void usage()
 {
 	std::cout << "usage: " << program_name.c_str() << " [options] [filename]\n";
 	std::cout << "  where \n";
-	std::cout << "    filename is path to Patty program\n";
+	std::cout << "    filename is path to Patty program (- for standard input)\n";
 	std::cout << "      without filename REPL mode is launched\n\n";
 	std::cout << "    options is one of:\n";
+	std::cout << "      --alloc-stats  print number of heap allocations and list copies made by program when it ends\n";
+	std::cout << "      --compile   store read program in .pattyc file next to it, later runs load it without parsing\n";
 	std::cout << "      --doc       launch documentation in default browser (using xdg-open)\n";
+	std::cout << "      --engine=tree|vm  evaluate with tree walking interpreter (default) or bytecode VM\n";
+	std::cout << "      --line-buffered  write output after every line (default when output is terminal)\n";
+	std::cout << "      --memo-limit=N  keep at most N elements of each seq-memo sequence and N results of each memo function\n";
 	std::cout << "      --no-eval   don't evaluate\n";
+	std::cout << "      --no-fold   don't replace constant expressions by their values (for debugging)\n";
+	std::cout << "      --threads=N number of threads used by ptake (default is number of cores)\n";
 	std::cout << "      --version   print version info\n";
 	std::cout << "      -h,--help   print usage info\n";
 	std::cout << std::flush;
@@ -59,6 +78,127 @@ void print_version(bool full = true)
 	}
 }
 
+// Contents of regular file, nothing for others (like pipes)
+static std::string_view map_file(int fd)
+{
+	if (struct stat st; fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if (auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			return { static_cast<char const*>(p), std::size_t(st.st_size) };
+		}
+	}
+	return {};
+}
+
+// Top-level forms of program, read one at a time. Regular files are memory mapped,
+// others (like pipes or standard input) are read in chunks when next form is needed,
+// so evaluation starts before the whole program arrives
+struct Program_Source
+{
+	explicit Program_Source(fs::path const& path, bool load_compiled = true)
+	{
+		fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			error_fatal("cannot open file '{}'"_format(path.c_str()));
+
+		mapping = map_file(fd);
+		complete = !mapping.empty();
+
+		// Forms are loaded from compiled program instead, when it was compiled from this source
+		if (load_compiled && complete) {
+			if (int const compiled_fd = open(compiled_path(path).c_str(), O_RDONLY); compiled_fd >= 0) {
+				compiled_mapping = map_file(compiled_fd);
+				close(compiled_fd);
+				compiled = Compiled_Reader::open(compiled_mapping, source_hash(mapping));
+			}
+		}
+	}
+
+	Program_Source(Program_Source const&) = delete;
+	Program_Source& operator=(Program_Source const&) = delete;
+
+	~Program_Source()
+	{
+		for (auto mapped : { mapping, compiled_mapping })
+			if (!mapped.empty())
+				munmap(const_cast<char*>(mapped.data()), mapped.size());
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+
+	// Whole source, nothing when it is read in chunks
+	std::optional<std::string_view> text() const
+	{
+		return complete && !mapping.empty() ? std::optional(mapping) : std::nullopt;
+	}
+
+	// Nothing when there are no forms left
+	std::optional<Value> next()
+	{
+		if (compiled)
+			return compiled->next();
+
+		for (;;) {
+			auto const rest = (mapping.empty() ? std::string_view(buffer) : mapping).substr(consumed);
+			if (auto length = form_length(rest, complete)) {
+				auto form = rest.substr(0, *length);
+				consumed += *length;
+				release_mapped();
+				auto value = read(form);
+				// Only whitespace and comments were left
+				if (value.type == Value::Type::Nil && complete && *length == rest.size())
+					return std::nullopt;
+				return value;
+			}
+
+			// Form continues past what was read so far. Output of previous forms
+			// is flushed before waiting for it, so it appears right away
+			flush_output();
+			buffer.erase(0, consumed);
+			consumed = 0;
+			char chunk[1 << 16];
+			if (auto const n = ::read(fd, chunk, sizeof(chunk)); n > 0)
+				buffer.append(chunk, n);
+			else
+				complete = true;
+		}
+	}
+
+private:
+	// Pages of already read forms are dropped, so resident memory does not grow with length of program
+	void release_mapped()
+	{
+		static auto const Page_Size = std::size_t(sysconf(_SC_PAGESIZE));
+		constexpr std::size_t Release_Step = 1 << 20;
+
+		if (mapping.empty() || consumed - released < Release_Step)
+			return;
+		auto const end = consumed / Page_Size * Page_Size;
+		madvise(const_cast<char*>(mapping.data()) + released, end - released, MADV_DONTNEED);
+		released = end;
+	}
+
+	int fd = -1;
+	std::string_view mapping, compiled_mapping;
+	std::optional<Compiled_Reader> compiled;
+	std::string buffer;
+	std::size_t consumed = 0, released = 0;
+	bool complete = false;
+};
+
+Value evaluate(Context &ctx, Value value)
+{
+	resolve(ctx, value, {});
+	if (constant_folding)
+		fold_constants(ctx, value);
+
+	switch (engine) {
+	case Engine::Tree: return eval(ctx, std::move(value));
+	case Engine::Vm:   return execute(ctx, value);
+	}
+	return Value::nil();
+}
+
 void repl(Context &ctx)
 {
 	std::cout << " ____       _   _\n";
@@ -72,6 +212,7 @@ void repl(Context &ctx)
 
 	while (std::cin) {
 		std::string line;
+		flush_output();
 		std::cout << "> " << std::flush;
 
 		if (!std::getline(std::cin, line))
@@ -88,8 +229,9 @@ void repl(Context &ctx)
 
 		if (source.starts_with(':')) {
 			if (source == ":global") {
-				for (auto &[name, value] : ctx.scopes.front()) {
-					fmt::print("{}\t{}\n", name, value);
+				for (auto const& global : ctx.globals) {
+					if (global.defined)
+						fmt::print("{}\t{}\n", symbol_name(global.name), global.value);
 				}
 				continue;
 			}
@@ -108,7 +250,7 @@ void repl(Context &ctx)
 		}
 
 		auto value = read(source);
-		print(eval(ctx, std::move(value)));
+		print(evaluate(ctx, std::move(value)));
 	}
 }
 
@@ -119,6 +261,9 @@ int main(int, char **argv)
 	program_name = fs::path(*argv++).filename();
 
 	[[maybe_unused]] bool no_eval = false;
+	bool compile = false;
+	bool alloc_stats = false;
+	line_buffered = isatty(STDOUT_FILENO);
 
 	for (; *argv != nullptr; ++argv) {
 		if (*argv == "-h"sv || *argv == "--help"sv) {
@@ -136,6 +281,27 @@ int main(int, char **argv)
 		}
 
 		if (*argv == "--no-eval"sv) { no_eval = true; continue; }
+		if (*argv == "--no-fold"sv) { constant_folding = false; continue; }
+		if (*argv == "--compile"sv) { compile = true; continue; }
+		if (*argv == "--alloc-stats"sv) { alloc_stats = true; continue; }
+		if (*argv == "--line-buffered"sv) { line_buffered = true; continue; }
+
+		if (*argv == "--engine=tree"sv) { engine = Engine::Tree; continue; }
+		if (*argv == "--engine=vm"sv)   { engine = Engine::Vm;   continue; }
+
+		if (std::string_view arg = *argv; arg.starts_with("--memo-limit=")) {
+			arg.remove_prefix("--memo-limit="sv.size());
+			if (auto [p, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), memo_limit); ec != std::errc{} || p != arg.data() + arg.size())
+				error_fatal("--memo-limit expects non-negative integer");
+			continue;
+		}
+
+		if (std::string_view arg = *argv; arg.starts_with("--threads=")) {
+			arg.remove_prefix("--threads="sv.size());
+			if (auto [p, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), thread_count); ec != std::errc{} || p != arg.data() + arg.size() || thread_count == 0)
+				error_fatal("--threads expects positive integer");
+			continue;
+		}
 
 		if (filename.empty()) {
 			filename = *argv;
@@ -144,6 +310,22 @@ int main(int, char **argv)
 		}
 	}
 
+	if (compile) {
+		if (filename.empty())
+			error_fatal("--compile requires program file");
+
+		Program_Source source(filename, false);
+		auto const text = source.text();
+		if (!text)
+			error_fatal("--compile requires program in regular file");
+
+		Compiled_Writer writer(compiled_path(filename), source_hash(*text));
+		while (auto value = source.next())
+			writer.write(*value);
+		writer.finish();
+		return 0;
+	}
+
 	Context ctx;
 	intrinsics(ctx);
 
@@ -152,19 +334,16 @@ int main(int, char **argv)
 		return 0;
 	}
 
-	std::ifstream source_file(filename);
-	if (!source_file) {
-		error_fatal("cannot open file '{}'"_format(filename.c_str()));
+	// Each form is released after evaluation, so memory does not grow with length of program
+	Program_Source source(filename);
+	while (auto value = source.next()) {
+		if (!no_eval) {
+			(void)evaluate(ctx, std::move(*value));
+		} else {
+			print(*value);
+		}
 	}
 
-	std::string code(std::istreambuf_iterator<char>(source_file), {});
-
-	std::string_view source = code;
-	auto value = read(source);
-
-	if (!no_eval) {
-		(void)eval(ctx, std::move(value));
-	} else {
-		print(value);
-	}
+	if (alloc_stats)
+		fmt::print(stderr, "heap allocations: {}\nlist copies: {}\n", heap_allocations(), Value::List::copies.load());
 }
@@ -1,12 +1,19 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdio>
 #include <filesystem>
 #include <functional>
 #include <list>
+#include <memory>
+#include <optional>
 #include <ranges>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
@@ -20,15 +27,50 @@ using namespace fmt::literals;
 
 struct Value;
 struct Context;
+struct Intrinsic;
+struct Memo_Function;
+struct Lexical_Scopes;
 
 struct Sequence;
 struct Dynamic_Generator;
 struct Circular_Generator;
 struct Composed_Generator;
+struct Recurrence_Generator;
 struct Value_Sequence;
 
+// Names of symbols are interned, so symbol values and scopes hold only their index
+using Symbol_Id = std::uint32_t;
+Symbol_Id intern(std::string_view name);
+std::string const& symbol_name(Symbol_Id id);
+
 extern fs::path program_name;
 extern fs::path filename;
+extern std::size_t memo_limit;
+extern unsigned thread_count;
+extern bool parallel_section;
+extern bool line_buffered;
+
+// Small objects (boxes of values, storage of lists) come from per-thread pools of size
+// classes, larger ones are passed to global operator new (see alloc.cc)
+void* pool_allocate(std::size_t size);
+void pool_release(void *p, std::size_t size);
+
+template<typename T>
+struct Pool_Allocator
+{
+	using value_type = T;
+
+	Pool_Allocator() = default;
+	template<typename U> Pool_Allocator(Pool_Allocator<U> const&) {}
+
+	T* allocate(std::size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+	void deallocate(T *p, std::size_t n) { pool_release(p, n * sizeof(T)); }
+
+	template<typename U> bool operator==(Pool_Allocator<U> const&) const { return true; }
+};
+
+// Number of heap allocations made since start of program (see --alloc-stats)
+std::uint64_t heap_allocations();
 
 inline void error(auto const& message)
 {
@@ -42,53 +84,290 @@ inline void error_fatal(auto const& ...message)
 	std::exit(1);
 }
 
-Value eval(Context &ctx, Value value);
+Value eval(Context &ctx, Value const& expr);
+Value execute(Context &ctx, Value const& value);
 void print(Value const& value);
+
+// Output of program is collected in buffer, which is written when it fills up, at exit,
+// on flush_output, and after every line when line_buffered is set (see --line-buffered)
+fmt::memory_buffer& output_buffer();
+void output_written();
+void flush_output();
+
+// Standard input is read in large chunks, integers are parsed straight from them.
+// Appends at most n next integers to ints and returns how many were appended,
+// fewer only when input has ended. Anything other than integer separates them
+std::size_t read_ints(std::vector<std::int64_t> &ints, std::size_t n);
 Value read(std::string_view &source);
+
+// Length of source prefix that holds next top-level form (with whitespace and comments before it),
+// or nothing when source ends before form does and more of it may come. Complete source
+// is not expected to grow, so its incomplete form extends to the end
+std::optional<std::size_t> form_length(std::string_view source, bool complete);
 void intrinsics(Context &ctx);
 
+// Program compiled with --compile is stored next to its source in .pattyc file, as forms
+// already read, so later runs load it without parsing. It is used only while hash of source matches
+std::uint64_t source_hash(std::string_view source);
+fs::path compiled_path(fs::path const& source);
+
+struct Compiled_Writer
+{
+	Compiled_Writer(fs::path const& path, std::uint64_t hash);
+	~Compiled_Writer();
+
+	void write(Value const& form);
+	void finish();
+
+private:
+	void flush();
+	void varint(std::uint64_t n);
+	void encode(Value const& value);
+
+	fs::path path, temporary;
+	std::FILE *file = nullptr;
+	std::string out;
+	std::unordered_map<Symbol_Id, std::uint32_t> symbols; // indexes in order of first occurrence
+};
+
+// Decodes forms straight from contents of .pattyc file, only strings and names of symbols are copied
+struct Compiled_Reader
+{
+	// Nothing when contents were not compiled from source with given hash
+	static std::optional<Compiled_Reader> open(std::string_view contents, std::uint64_t hash);
+
+	// Nothing when there are no forms left
+	std::optional<Value> next();
+
+private:
+	std::uint64_t varint();
+	std::string_view bytes();
+	Value decode();
+
+	std::string_view rest;
+	std::vector<Symbol_Id> symbols;
+};
+
+// Calls task for every index in [0, count) on thread pool. Each thread evaluates in its own
+// copy of the context, state shared between them must not be modified (see parallel_section)
+void parallel_for(Context &ctx, std::size_t count, std::function<void(Context&, std::size_t)> const& task);
+Value parallel_take(Context &ctx, Sequence &seq, std::size_t n);
+Value parallel_map(Context &ctx, Value const& op, std::vector<Value> const& elements);
+Value parallel_filter(Context &ctx, Value const& op, std::vector<Value> const& elements);
+Value parallel_reduce(Context &ctx, Value const& op, std::vector<Value> const& elements);
+
+// Exits with error when evaluating expr may call intrinsic with side effects
+void require_pure(Context &ctx, Value const& expr, std::string_view name);
+
+// Position in sequence from which elements are pulled in chunks, so consumers
+// do not need whole sequence materialized at once
+struct Cursor
+{
+	virtual ~Cursor() = default;
+
+	// Appends at most n next elements to chunk and returns how many were appended.
+	// Fewer than n elements are appended only when sequence has ended
+	virtual std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) = 0;
+};
+
 struct Sequence
 {
+	// Number of elements that consumers pull from cursor at once
+	static constexpr std::size_t Chunk_Size = 256;
+
 	static Value take(Sequence &seq, Context &ctx, unsigned n);
 
+	// Sequence must outlive cursor
+	virtual std::unique_ptr<Cursor> cursor() = 0;
+
 	virtual Value index(Context &ctx, unsigned n) = 0;
-	virtual Value take(Context &ctx, unsigned n) = 0;
+	virtual Value take(Context &ctx, unsigned n);
 	virtual Value len(Context &ctx) = 0;
 	virtual Value pop(Context &ctx, unsigned n) = 0;
 };
 
 struct Value
 {
-	enum class Type
+	// Where symbol can be found, computed by resolution pass (see resolve)
+	struct Address
+	{
+		enum class Kind : std::uint8_t
+		{
+			Unresolved, // search scopes by name
+			Local,      // slot in scope depth levels below innermost one
+			Global      // slot in global scope
+		} kind : 2 = Kind::Unresolved;
+
+		std::uint32_t depth : 6 = 0;
+		std::uint32_t slot : 24 = 0;
+
+		static constexpr std::uint32_t Max_Depth = (1u << 6) - 1;
+		static constexpr std::uint32_t Max_Slot = (1u << 24) - 1;
+	};
+
+	enum class Type : std::uint8_t
 	{
 		Nil,
 		String,
 		Symbol,
 		Int,
 		List,
-		Cpp_Function,
-		Sequence
-	} type = Type::Nil;
+		Cpp_Function, // index of intrinsic in static table, see Intrinsic
+		Sequence,
+		Int_Vector, // list of integers stored contiguously, degrades to List when modified as one
+		Memo_Function // user function with cache of its results, see memo
+	};
+
+	// Payload of heap allocated values, shared between copies until one of them is modified.
+	// Copies may live on different threads (see ptake), so reference count is atomic
+	struct Object
+	{
+		std::atomic<std::uint32_t> references = 1;
+
+		static void* operator new(std::size_t size) { return pool_allocate(size); }
+		static void operator delete(void *p, std::size_t size) { pool_release(p, size); }
+	};
+
+	template<typename T>
+	struct Box : Object
+	{
+		T value;
+	};
+
+	// Slice of vector shared between lists, so taking prefix, suffix or element by index
+	// does not walk or copy elements. Shared elements are copied only before modification.
+	struct List
+	{
+		using value_type = Value;
+		using iterator = Value*;
+		using const_iterator = Value const*;
+
+		List() = default;
+		List(std::initializer_list<Value> values) : List(values.begin(), values.end()) {}
+
+		template<std::input_iterator It>
+		List(It first, It last) { assign(first, last); }
+
+		inline std::size_t size() const { return count; }
+		inline bool empty() const { return count == 0; }
+
+		inline const_iterator begin() const { return storage ? storage->data() + offset : nullptr; }
+		inline const_iterator end() const { return begin() + count; }
+		inline iterator begin() { detach(); return storage ? storage->data() + offset : nullptr; }
+		inline iterator end() { return begin() + count; }
+
+		inline Value const& operator[](std::size_t i) const { assert(i < count); return begin()[i]; }
+		inline Value& operator[](std::size_t i) { assert(i < count); return begin()[i]; }
+		inline Value const& front() const { return (*this)[0]; }
+		inline Value& front() { return (*this)[0]; }
+		inline Value const& back() const { return (*this)[count - 1]; }
+		inline Value& back() { return (*this)[count - 1]; }
+
+		// Removing elements only narrows the slice
+		inline void drop_front(std::size_t n) { assert(n <= count); offset += n; count -= n; }
+		inline void truncate(std::size_t n) { count = std::min(count, n); }
+		inline void pop_front() { drop_front(1); }
+		inline void pop_back()
+		{
+			assert(count > 0);
+			if (storage.use_count() == 1 && offset + count == storage->size())
+				storage->pop_back();
+			--count;
+		}
+
+		template<typename ...Args>
+		Value& emplace_back(Args&& ...args)
+		{
+			reserve_back();
+			auto &value = storage->emplace_back(std::forward<Args>(args)...);
+			++count;
+			return value;
+		}
+
+		inline void push_back(Value value) { emplace_back(std::move(value)); }
+		void push_front(Value value);
+		void append(List const& other);
+
+		// Storage shared with other lists may grow in place only when single thread
+		// evaluates, otherwise two threads could append to it at the same time
+		static inline bool grow_shared = true;
+
+		// Number of times elements were copied into new storage (see --alloc-stats)
+		static inline std::atomic<std::uint64_t> copies = 0;
+
+		template<std::input_iterator It>
+		void assign(It first, It last)
+		{
+			storage = make_storage(first, last);
+			offset = 0;
+			count = storage->size();
+		}
+
+	private:
+		using Storage = std::vector<Value, Pool_Allocator<Value>>;
+
+		static std::shared_ptr<Storage> make_storage(auto&& ...args)
+		{
+			return std::allocate_shared<Storage>(Pool_Allocator<Storage>{}, std::forward<decltype(args)>(args)...);
+		}
+
+		void detach();
+		void reserve_back();
+
+		std::shared_ptr<Storage> storage;
+		std::size_t offset = 0, count = 0;
+	};
+
+	Type type = Type::Nil;
+	Address address = {};
+	union
+	{
+		std::int64_t ival = 0;
+		Object *object;
+	};
+
+	inline Value() = default;
+	explicit Value(Type type);
+	explicit Value(List list);
+	explicit Value(std::shared_ptr<Sequence> sequence);
+
+	inline Value(Value const& other) : type(other.type), address(other.address), ival(other.ival) { if (boxed()) object->references.fetch_add(1, std::memory_order_relaxed); }
+	inline Value(Value &&other) noexcept : type(other.type), address(other.address), ival(other.ival) { other.type = Type::Nil; other.ival = 0; }
+	inline ~Value() { if (boxed()) release(); }
 
-	std::string sval = {};
-	std::int64_t ival = 0;
-	std::list<Value> list = {};
-	std::function<Value(struct Context&, Value)> cpp_function = nullptr;
-	std::shared_ptr<Sequence> sequence = nullptr;
+	inline Value& operator=(Value const& other) { Value(other).swap(*this); return *this; }
+	inline Value& operator=(Value &&other) noexcept { Value(std::move(other)).swap(*this); return *this; }
+	inline void swap(Value &other) noexcept { std::swap(type, other.type); std::swap(address, other.address); std::swap(ival, other.ival); }
 
 	static inline Value nil() { return {}; }
-	static inline Value string(std::string_view src) { return Value { Type::String, std::string(src.data(), src.size()) }; }
-	static inline Value symbol(std::string_view src) { return Value { Type::Symbol, std::string(src.data(), src.size()) }; }
-	static inline Value cpp(char const *name, std::function<Value(struct Context&, Value)> &&function) { auto v = Value { Type::Cpp_Function }; v.cpp_function = std::move(function); v.sval = name; return v; }
-	static inline Value integer(int64_t ival) { auto v = Value { Type::Int }; v.ival = ival; return v; }
+	static Value string(std::string_view src);
+	static Value symbol(std::string_view src);
+	static Value cpp(char const *name, Value (*function)(struct Context&, Value const&));
+	static inline Value integer(int64_t ival) { auto v = Value(Type::Int); v.ival = ival; return v; }
+	static Value int_vector(std::vector<std::int64_t> ints);
+
+	// Name of symbol or C++ function, content of string
+	std::string const& sval() const;
+	inline Symbol_Id symbol_id() const { assert(type == Type::Symbol); return Symbol_Id(ival); }
+	List const& list() const { assert(type == Type::List); return static_cast<Box<List>*>(object)->value; }
+	List& mutable_list();
+	std::vector<std::int64_t> const& ints() const { assert(type == Type::Int_Vector); return static_cast<Box<std::vector<std::int64_t>>*>(object)->value; }
+	std::vector<std::int64_t>& mutable_ints();
+
+	// List with the same elements, for code that accesses elements as values
+	Value as_list() const;
+	Intrinsic const& intrinsic() const;
+	// Cache is shared by every copy and may be updated through any of them
+	Memo_Function& memo_function() const;
+	std::shared_ptr<Sequence> const& sequence() const { assert(type == Type::Sequence); return static_cast<Box<std::shared_ptr<Sequence>>*>(object)->value; }
 
 	Value& at(unsigned index) &;
 	Value&& at(unsigned index) &&;
+	Value const& at(unsigned index) const&;
 
-	inline auto tail() { return std::ranges::subrange(std::next(list.begin()), list.end()); }
-	inline auto tail() const { return std::ranges::subrange(std::next(list.cbegin()), list.cend()); }
-	inline auto init() { return std::ranges::subrange(list.begin(), std::prev(list.end())); }
-	inline auto init() const { return std::ranges::subrange(list.cbegin(), std::prev(list.cend())); }
+	inline auto tail() { auto &list = mutable_list(); return std::ranges::subrange(std::next(list.begin()), list.end()); }
+	inline auto tail() const { return std::ranges::subrange(std::next(list().begin()), list().end()); }
+	inline auto init() const { return std::ranges::subrange(list().begin(), std::prev(list().end())); }
 
 	bool coarce_bool() const;
 
@@ -103,13 +382,123 @@ struct Value
 	std::optional<uint64_t> size(Context &ctx) const;
 	Value index(Context &ctx, unsigned n);
 
+	// Equal values have equal hashes, also lists and int vectors with the same elements
+	std::size_t hash() const;
+
 	bool is_static_expression(Context &ctx) const;
 	void subst(Context &ctx);
+	void resolve(Context &ctx, Lexical_Scopes &lexical);
+
+private:
+	inline bool boxed() const { return type != Type::Nil && type != Type::Int && type != Type::Symbol && type != Type::Cpp_Function; }
+	void release();
 };
 
+static_assert(sizeof(Value) == 16, "Value should fit in two machine words");
+
+// Builtin function. Every intrinsic is registered once in static table, before evaluation
+// starts, and values refer to it by index. They are then copied without reference counting
+// and compared by index, and call goes straight to the function
+struct Intrinsic
+{
+	using Function = Value(*)(Context &ctx, Value const& args);
+
+	std::string name;
+	Function function;
+
+	static inline std::vector<Intrinsic> table;
+
+	static constexpr unsigned Not_Found = -1;
+	static unsigned find(std::string_view name);
+};
+
+inline Intrinsic const& Value::intrinsic() const
+{
+	assert(type == Type::Cpp_Function);
+	return Intrinsic::table[ival];
+}
+
+template<>
+struct std::hash<Value>
+{
+	std::size_t operator()(Value const& value) const { return value.hash(); }
+};
+
+// User function wrapped by memo. Results are kept for at most capacity distinct argument
+// lists, when it is exceeded the least recently used one is forgotten
+struct Memo_Function
+{
+	using Entry = std::pair<Value, Value>; // arguments, result
+	using Entries = std::list<Entry, Pool_Allocator<Entry>>;
+
+	Value function;
+	std::size_t capacity;
+
+	Entries entries; // most recently used first
+	std::unordered_map<Value, Entries::iterator, std::hash<Value>, std::equal_to<Value>,
+		Pool_Allocator<std::pair<Value const, Entries::iterator>>> index;
+
+	// While threads evaluate (see parallel_section) cache is only read
+	std::optional<Value> find(Value const& args);
+	void insert(Value args, Value result);
+};
+
+inline Memo_Function& Value::memo_function() const
+{
+	assert(type == Type::Memo_Function);
+	return static_cast<Box<Memo_Function>*>(object)->value;
+}
+
+// Names bound in scopes that will be on top of the stack when expression is evaluated
+struct Lexical_Scopes
+{
+	std::vector<std::vector<Symbol_Id>> scopes; // innermost last
+	std::vector<Symbol_Id> unstable;            // introduced by def, so their slots are unknown
+};
+
+// Resolve symbols of body that will be evaluated in new scope with given names bound in order
+void resolve(Context &ctx, Value &body, std::vector<Symbol_Id> const& names);
+
+// Resolve body of user function in form of ((params...) body)
+void resolve_function(Context &ctx, Value &function);
+
+// Replaces calls of arithmetic and comparisons with integer arguments by their results and
+// calls of list by the list they produce. Done for top-level forms before they are evaluated,
+// unless disabled with --no-fold
+extern bool constant_folding;
+void fold_constants(Context &ctx, Value &value);
+
+// Value that evaluates to itself, so it may replace expression that produced it
+bool is_literal(Value const& value);
+
 struct Context
 {
-	std::vector<std::unordered_map<std::string, Value>> scopes;
+	// Local scope with values stored in order of definition, so they can be accessed by slot
+	struct Scope
+	{
+		std::vector<Symbol_Id> names;
+		std::vector<Value> values;
+		std::vector<unsigned> shadowed; // global slots with the same names as locals
+	};
+
+	struct Global
+	{
+		Symbol_Id name;
+		Value value;
+		bool defined = false;
+		unsigned shadowed = 0; // number of local bindings hiding this one
+	};
+
+	std::vector<Scope> scopes;
+	std::vector<Scope> spare_scopes; // popped scopes, kept so their buffers are reused by next calls
+	std::vector<Global> globals;
+	std::vector<unsigned> global_slots; // indexed by symbol id
+
+	// Changed whenever global is defined. Call sites cache global slot that name of callee
+	// resolved to for one epoch, locals that hide it later are seen by its shadowed count
+	std::uint64_t epoch = 1;
+
+	static constexpr unsigned No_Slot = -1;
 
 	struct Scope_Guard
 	{
@@ -119,34 +508,65 @@ struct Context
 
 	struct Define_Descriptor
 	{
-		void operator=(decltype(Value{}.cpp_function) func);
+		void operator=(Intrinsic::Function function);
 		char const* name;
 		Context *ctx;
 	};
 
-	Value* operator[](std::string const& name);
-	void assign(std::string const& name, Value value);
+	Value* operator[](Symbol_Id name);
+	Value* operator[](Value const& symbol);
+	void assign(Symbol_Id name, Value value);
 	Define_Descriptor define(char const* val);
 	Scope_Guard local_scope();
+	Scope new_scope();
+	Scope& push_scope();
+	void pop_scope();
+
+	// Pushes scope with values of arguments, binding them to names of parameters
+	void enter(Scope frame, Value const& formals);
+
+	// Checks if parameters bind every name of innermost scope, so it can be replaced
+	// by callee scope without changing what is visible from callee
+	bool rebinds_all(Value const& formals) const;
+
+	unsigned global_slot(Symbol_Id name);
+	Value::Address address(Symbol_Id name, Lexical_Scopes const& lexical);
 };
 
 struct Dynamic_Generator : Sequence
 {
+	// Elements produced so far, shared by every copy of memoizing sequence (see seq-memo)
+	struct Memo
+	{
+		std::vector<Value> values;
+		std::size_t limit;
+	};
+
 	Value expr;
 	int64_t start = 0;
+	std::shared_ptr<Memo> memo = nullptr;
 
+	// Coefficients (from the lowest power) when expr is polynomial in n with integer
+	// constants, so elements are computed without evaluation. Empty otherwise
+	std::vector<std::int64_t> polynomial;
+
+	std::unique_ptr<Cursor> cursor() override;
 	Value index(Context &ctx, unsigned n) override;
 	Value take(Context &ctx, unsigned n) override;
 	Value len(Context &ctx) override;
 	Value pop(Context &ctx, unsigned n) override;
+
+	Value produce(Context &ctx, int64_t n);
+	Value memoized(Context &ctx, int64_t n);
+	void specialize(Context &ctx);
 };
 
 struct Circular_Generator : Sequence
 {
 	Value value_set;
 
-  Value index(Context &ctx, unsigned n) override;
-	Value take(Context &ctx, unsigned n) override;
+	std::unique_ptr<Cursor> cursor() override;
+	Value index(Context &ctx, unsigned n) override;
 	Value len(Context &ctx) override;
 	Value pop(Context &ctx, unsigned n) override;
 };
@@ -155,16 +575,62 @@ struct Composed_Generator : Sequence
 {
 	std::vector<std::shared_ptr<Sequence>> children;
 
+	// Filled by index_children once children are added. End offsets of static values
+	// of leading circular children, and length of the whole sequence (nil when unbounded)
+	std::vector<std::size_t> offsets;
+	Value length;
+
+	void index_children(Context &ctx);
+
+	std::unique_ptr<Cursor> cursor() override;
+	Value index(Context &ctx, unsigned n) override;
+	Value len(Context &ctx) override;
+	Value pop(Context &ctx, unsigned n) override;
+};
+
+// Integer prefix followed by linear recurrence with constant coefficients over
+// previous elements of the sequence itself, like (seq 1 1 (+ (index n fibs) (index (+ n 1) fibs))).
+// Elements are computed by matrix exponentiation, without evaluating recursive references
+struct Recurrence_Generator : Sequence
+{
+	std::vector<int64_t> initial;      // static prefix, its length is order of recurrence
+	std::vector<int64_t> coefficients; // of elements n, n + 1, ... n + order - 1
+	int64_t constant = 0;
+	int64_t start = 0;
+
+	// Symbols used in recurrence must refer to original sequence, since they are resolved lazily.
+	// Otherwise elements are produced by general sequence
+	std::vector<Value> references;
+	Sequence const* origin = this;
+	std::shared_ptr<Composed_Generator> general;
+
+	static std::shared_ptr<Recurrence_Generator> recognize(Context &ctx, std::shared_ptr<Composed_Generator> const& composed);
+
+	std::unique_ptr<Cursor> cursor() override;
 	Value index(Context &ctx, unsigned n) override;
-	Value take(Context &ctx, unsigned n) override;
 	Value len(Context &ctx) override;
 	Value pop(Context &ctx, unsigned n) override;
+
+	bool is_self_referential(Context &ctx) const;
+	std::vector<int64_t> window(int64_t n) const;
 };
 
 struct Value_Sequence : Sequence
 {
 	Value expr;
 
+	std::unique_ptr<Cursor> cursor() override;
+	Value index(Context &ctx, unsigned n) override;
+	Value take(Context &ctx, unsigned n) override;
+	Value len(Context &ctx) override;
+	Value pop(Context &ctx, unsigned n) override;
+};
+
+// Integers of standard input, read as elements are pulled. They are not kept,
+// so each of them is produced once, to whoever pulls it first
+struct Input_Sequence : Sequence
+{
+	std::unique_ptr<Cursor> cursor() override;
 	Value index(Context &ctx, unsigned n) override;
 	Value take(Context &ctx, unsigned n) override;
 	Value len(Context &ctx) override;
@@ -176,8 +642,8 @@ struct Zip_Sequence : Sequence
 	std::vector<std::shared_ptr<Sequence>> children;
 	std::function<Value(Context&, Value)> zipper;
 
+	std::unique_ptr<Cursor> cursor() override;
 	Value index(Context &ctx, unsigned n) override;
-	Value take(Context &ctx, unsigned n) override;
 	Value len(Context &ctx) override;
 	Value pop(Context &ctx, unsigned n) override;
 };
@@ -3,47 +3,219 @@
 #include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <optional>
+#include <span>
 
 Value Sequence::take(Sequence &seq, Context &ctx, unsigned n)
 {
 	auto result = seq.take(ctx, n);
 	if (result.type == Value::Type::List) {
 		unsigned i = 0;
-		for (auto &el : result.list) {
+		for (auto const& el : result.list()) {
 			if (el.type == Value::Type::Sequence) {
 				auto seq = el;
-				auto result2 = Sequence::take(*el.sequence, ctx, n - i + 1);
-				result.list.erase(std::next(result.list.begin(), i), result.list.end());
-
-				for (auto &el2 : result2.list)
-					result.list.push_back(std::move(el2));
+				auto result2 = Sequence::take(*seq.sequence(), ctx, n - i + 1);
+				auto &list = result.mutable_list();
+				list.truncate(i);
+				list.append(result2.as_list().list());
 				return result;
 			}
 			++i;
 		}
+
+		// Integer only prefixes are stored unboxed
+		auto const& list = result.list();
+		if (!list.empty() && std::ranges::all_of(list, [](Value const& el) { return el.type == Value::Type::Int; })) {
+			std::vector<int64_t> ints;
+			ints.reserve(list.size());
+			for (auto const& el : list)
+				ints.push_back(el.ival);
+			return Value::int_vector(std::move(ints));
+		}
 	}
 	return result;
 }
 
-Value Dynamic_Generator::take(Context &ctx, unsigned n)
+Value Sequence::take(Context &ctx, unsigned n)
 {
-	Value result;
-	result.type = Value::Type::List;
-	for (int64_t i = 0; i < n; ++i) {
-		auto local_scope_guard = ctx.local_scope();
-		ctx.assign("n", Value::integer(i + start));
-		result.list.push_back(eval(ctx, expr));
+	Value result(Value::Type::List);
+	auto &list = result.mutable_list();
+
+	auto it = cursor();
+	std::vector<Value> chunk;
+	while (list.size() < n) {
+		auto const wanted = std::min<std::size_t>(Chunk_Size, n - list.size());
+		auto const pulled = it->next(ctx, chunk, wanted);
+		for (auto &value : chunk)
+			list.push_back(std::move(value));
+		chunk.clear();
+		if (pulled < wanted)
+			break;
 	}
 	return result;
 }
 
-Value Dynamic_Generator::index(Context &ctx, unsigned n)
+Value Dynamic_Generator::produce(Context &ctx, int64_t n)
 {
+	static auto const n_symbol = intern("n");
+
 	auto local_scope_guard = ctx.local_scope();
-	ctx.assign("n", Value::integer(n + start));
+	ctx.assign(n_symbol, Value::integer(n));
 	return eval(ctx, expr);
 }
 
+// Fills memo buffer up to n, so self-referential generators (like fibs)
+// only ever evaluate each element once
+Value Dynamic_Generator::memoized(Context &ctx, int64_t n)
+{
+	auto &values = memo->values;
+	if (std::size_t(n) < values.size())
+		return values[n];
+
+	if (std::size_t(n) >= memo->limit || parallel_section)
+		return produce(ctx, n);
+
+	for (auto i = int64_t(values.size()); i <= n; ++i) {
+		auto value = produce(ctx, i);
+		// Evaluation could already memoize this element through recursion
+		if (values.size() == std::size_t(i))
+			values.push_back(std::move(value));
+	}
+	return values[n];
+}
+
+static constexpr std::size_t Max_Polynomial_Degree = 8;
+
+// Coefficients of expression as polynomial in n, if it only applies builtin +, - and *
+// to n and integer constants
+static std::optional<std::vector<int64_t>> as_polynomial(Context &ctx, Value const& expr)
+{
+	static auto const n = intern("n");
+
+	switch (expr.type) {
+	case Value::Type::Int:
+		return std::vector { expr.ival };
+
+	case Value::Type::Symbol:
+		if (expr.symbol_id() == n)
+			return std::vector<int64_t> { 0, 1 };
+		return std::nullopt;
+
+	case Value::Type::List:
+		{
+			auto const& list = expr.list();
+			if (list.size() < 2 || list.front().type != Value::Type::Symbol)
+				return std::nullopt;
+
+			auto const op = ctx[list.front()];
+			if (!op || op->type != Value::Type::Cpp_Function)
+				return std::nullopt;
+			if (auto const& name = op->sval(); name != "+" && name != "-" && name != "*")
+				return std::nullopt;
+
+			auto result = as_polynomial(ctx, list[1]);
+			for (auto arg = std::next(list.begin(), 2); result && arg != list.end(); ++arg) {
+				auto const other = as_polynomial(ctx, *arg);
+				if (!other)
+					return std::nullopt;
+
+				auto &lhs = *result;
+				auto const& rhs = *other;
+				switch (op->sval()[0]) {
+				case '+':
+				case '-':
+					lhs.resize(std::max(lhs.size(), rhs.size()));
+					for (auto i = 0u; i < rhs.size(); ++i)
+						lhs[i] += op->sval()[0] == '+' ? rhs[i] : -rhs[i];
+					break;
+
+				case '*':
+					{
+						if (lhs.size() + rhs.size() - 2 > Max_Polynomial_Degree)
+							return std::nullopt;
+						std::vector<int64_t> product(lhs.size() + rhs.size() - 1);
+						for (auto i = 0u; i < lhs.size(); ++i)
+							for (auto j = 0u; j < rhs.size(); ++j)
+								product[i + j] += lhs[i] * rhs[j];
+						lhs = std::move(product);
+					}
+					break;
+				}
+			}
+			return result;
+		}
+
+	default:
+		return std::nullopt;
+	}
+}
+
+// Fills out with values of polynomial at from, from + 1, ... using Horner's method.
+// Inner loop works on contiguous integers, so compiler can vectorize it
+static void evaluate_polynomial(std::span<int64_t const> coefficients, int64_t from, std::span<int64_t> out)
+{
+	std::ranges::fill(out, 0);
+	for (auto c = coefficients.rbegin(); c != coefficients.rend(); ++c)
+		for (std::size_t i = 0; i < out.size(); ++i)
+			out[i] = out[i] * (from + int64_t(i)) + *c;
+}
+
+void Dynamic_Generator::specialize(Context &ctx)
+{
+	if (auto coefficients = as_polynomial(ctx, expr); coefficients)
+		polynomial = std::move(*coefficients);
+}
+
+struct Dynamic_Cursor : Cursor
+{
+	Dynamic_Generator &gen;
+	int64_t i = 0;
+	std::vector<int64_t> buffer = {};
+
+	Dynamic_Cursor(Dynamic_Generator &gen) : gen(gen) {}
+
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		if (!gen.polynomial.empty()) {
+			buffer.resize(n);
+			evaluate_polynomial(gen.polynomial, gen.start + i, buffer);
+			for (auto value : buffer)
+				chunk.push_back(Value::integer(value));
+			i += n;
+			return n;
+		}
+
+		for (auto end = i + int64_t(n); i < end; ++i)
+			chunk.push_back(gen.memo ? gen.memoized(ctx, gen.start + i) : gen.produce(ctx, gen.start + i));
+		return n;
+	}
+};
+
+std::unique_ptr<Cursor> Dynamic_Generator::cursor()
+{
+	return std::make_unique<Dynamic_Cursor>(*this);
+}
+
+Value Dynamic_Generator::index(Context &ctx, unsigned n)
+{
+	if (!polynomial.empty()) {
+		int64_t value;
+		evaluate_polynomial(polynomial, n + start, { &value, 1 });
+		return Value::integer(value);
+	}
+	return memo ? memoized(ctx, n + start) : produce(ctx, n + start);
+}
+
+Value Dynamic_Generator::take(Context &ctx, unsigned n)
+{
+	if (polynomial.empty())
+		return Sequence::take(ctx, n);
+
+	std::vector<int64_t> ints(n);
+	evaluate_polynomial(polynomial, start, ints);
+	return Value::int_vector(std::move(ints));
+}
+
 Value Dynamic_Generator::len(Context &)
 {
 	return Value::nil();
@@ -54,106 +226,410 @@ Value Dynamic_Generator::pop(Context&, unsigned n)
 	auto copy = *this;
 	copy.start += n;
 
-	Value retval;
-	retval.type = Value::Type::Sequence;
-	retval.sequence = std::make_shared<Dynamic_Generator>(copy);
-	return retval;
+	return Value(std::make_shared<Dynamic_Generator>(copy));
 }
 
-Value Circular_Generator::take(Context &ctx, unsigned n)
+struct Circular_Cursor : Cursor
 {
-	Value result;
-	result.type = Value::Type::List;
-	for (int64_t i = 0; i < n; ++i) {
-		auto local_scope_guard = ctx.local_scope();
-		ctx.assign("n", Value::integer(i));
-		result.list.push_back(eval(ctx, value_set.at(i % value_set.list.size())));
+	Circular_Generator &gen;
+	int64_t i = 0;
+
+	Circular_Cursor(Circular_Generator &gen) : gen(gen) {}
+
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		static auto const n_symbol = intern("n");
+
+		auto const& values = gen.value_set.list();
+		if (values.empty())
+			return 0;
+
+		for (auto end = i + int64_t(n); i < end; ++i) {
+			auto local_scope_guard = ctx.local_scope();
+			ctx.assign(n_symbol, Value::integer(i));
+			chunk.push_back(eval(ctx, values[i % values.size()]));
+		}
+		return n;
 	}
-	return result;
+};
+
+std::unique_ptr<Cursor> Circular_Generator::cursor()
+{
+	return std::make_unique<Circular_Cursor>(*this);
 }
 
 Value Circular_Generator::index(Context &ctx, unsigned n)
 {
-	return eval(ctx, value_set.at(n % value_set.list.size()));
+	if (value_set.list().empty())
+		return Value::nil();
+	return eval(ctx, std::as_const(value_set).at(n % value_set.list().size()));
 }
 
 Value Circular_Generator::len(Context&)
 {
-	return Value::integer(value_set.list.size());
+	return Value::integer(value_set.list().size());
 }
 
 Value Circular_Generator::pop(Context &, unsigned n)
 {
 	auto copy = *this;
 
-	if (n >= copy.value_set.list.size()) return Value::nil();
-	do copy.value_set.list.pop_front(); while (n-- >= 1);
+	if (n >= copy.value_set.list().size()) return Value::nil();
+	copy.value_set.mutable_list().drop_front(n + 1);
 
-	Value retval;
-	retval.type = Value::Type::Sequence;
-	retval.sequence = std::make_shared<Circular_Generator>(copy);
-	return retval;
+	return Value(std::make_shared<Circular_Generator>(copy));
 }
 
-Value Composed_Generator::take(Context &ctx, unsigned n)
+// Static values of circular children are produced once, other children until they end.
+// When the last child ends, elements continue from the first one
+struct Composed_Cursor : Cursor
 {
-	Value result;
-	result.type = Value::Type::List;
+	Composed_Generator &gen;
+	std::size_t child = 0;
+	std::size_t offset = 0; // in static values of current circular child
+	std::unique_ptr<Cursor> nested = nullptr;
+
+	Composed_Cursor(Composed_Generator &gen) : gen(gen) {}
+
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		std::size_t appended = 0, idle = 0;
+		while (appended < n && idle < gen.children.size()) {
+			auto &seq = *gen.children[child];
+			auto const wanted = n - appended;
+			std::size_t pulled = 0;
+			bool ended;
+
+			if (child < gen.offsets.size()) {
+				auto const& values = static_cast<Circular_Generator&>(seq).value_set.list();
+				for (; offset < values.size() && pulled < wanted; ++offset, ++pulled)
+					chunk.push_back(eval(ctx, values[offset]));
+				ended = offset == values.size();
+			} else {
+				if (!nested)
+					nested = seq.cursor();
+				pulled = nested->next(ctx, chunk, wanted);
+				ended = pulled < wanted;
+			}
 
-	for (;;) {
-		for (auto& gen : children) {
-			if (auto circular = dynamic_cast<Circular_Generator*>(gen.get()); circular != nullptr) {
-				unsigned copied = std::min(circular->value_set.list.size(), (size_t)n);
+			appended += pulled;
+			idle = pulled == 0 ? idle + 1 : 0;
+			if (ended) {
+				offset = 0;
+				nested = nullptr;
+				child = (child + 1) % gen.children.size();
+			}
+		}
+		return appended;
+	}
+};
 
-				auto it = circular->value_set.list.begin();
-				for (auto i = 0u; i < copied; ++i, ++it)
-					result.list.push_back(eval(ctx, *it));
+std::unique_ptr<Cursor> Composed_Generator::cursor()
+{
+	return std::make_unique<Composed_Cursor>(*this);
+}
 
-				if (copied == n)
-					return result;
-				else
-					n -= copied;
-			} else {
-				auto rest = gen->take(ctx, n);
-				std::ranges::move(std::move(rest.list), std::back_inserter(result.list));
-				return result;
-			}
+void Composed_Generator::index_children(Context &ctx)
+{
+	offsets.clear();
+	for (std::size_t end = 0; auto const& gen : children) {
+		auto const circular = dynamic_cast<Circular_Generator const*>(gen.get());
+		if (!circular)
+			break;
+		offsets.push_back(end += circular->value_set.list().size());
+	}
+
+	length = Value::integer(0);
+	for (auto const& gen : children) {
+		if (auto r = gen->len(ctx); r.type == Value::Type::Nil) {
+			length = Value::nil();
+			break;
+		} else {
+			length += r;
 		}
 	}
 }
 
+// Static values are found by binary search in offsets. Rest of the sequence is either
+// the first child that is not circular, or another cycle when every child is circular
 Value Composed_Generator::index(Context &ctx, unsigned n)
 {
-	for (;;) {
-		for (auto& gen : children) {
-			if (auto circular = dynamic_cast<Circular_Generator*>(gen.get()); circular != nullptr) {
-				auto size = circular->value_set.list.size();
-				if (n < size)
-					return circular->index(ctx, n);
-				n -= size;
+	auto const statics = offsets.empty() ? 0 : offsets.back();
+	if (n >= statics) {
+		if (offsets.size() < children.size())
+			return children[offsets.size()]->index(ctx, n - statics);
+		if (statics == 0)
+			return Value::nil();
+		n %= statics;
+	}
+
+	auto const child = std::ranges::upper_bound(offsets, n) - offsets.begin();
+	auto &circular = static_cast<Circular_Generator&>(*children[child]);
+	return circular.index(ctx, n - (child == 0 ? 0 : offsets[child - 1]));
+}
+
+Value Composed_Generator::len(Context&)
+{
+	return length;
+}
+
+Value Composed_Generator::pop(Context &, unsigned)
+{
+	assert(false && "unimplemented");
+}
+
+
+static bool is_intrinsic(Context &ctx, Value const& head, std::string_view name)
+{
+	if (head.type != Value::Type::Symbol)
+		return false;
+	auto const resolved = ctx[head];
+	return resolved && resolved->type == Value::Type::Cpp_Function && resolved->sval() == name;
+}
+
+// Adds scale * expr to recurrence, if expr is linear combination of integers
+// and (index n self) or (index (+ n k) self) elements
+static bool add_linear_form(Context &ctx, Recurrence_Generator &rec, Value const& expr, int64_t scale)
+{
+	static auto const n = intern("n");
+
+	if (expr.type == Value::Type::Int) {
+		rec.constant += scale * expr.ival;
+		return true;
+	}
+
+	if (expr.type != Value::Type::List || expr.list().size() < 2)
+		return false;
+
+	auto const& list = expr.list();
+	auto const& head = list.front();
+
+	if (is_intrinsic(ctx, head, "index") && list.size() == 3 && list[2].type == Value::Type::Symbol) {
+		int64_t offset = 0;
+		auto const& at = list[1];
+		if (at.type == Value::Type::List && at.list().size() == 3 && is_intrinsic(ctx, at.list()[0], "+")) {
+			auto const& lhs = at.list()[1], &rhs = at.list()[2];
+			if (lhs.type == Value::Type::Symbol && lhs.symbol_id() == n && rhs.type == Value::Type::Int)
+				offset = rhs.ival;
+			else if (rhs.type == Value::Type::Symbol && rhs.symbol_id() == n && lhs.type == Value::Type::Int)
+				offset = lhs.ival;
+			else
+				return false;
+		} else if (at.type != Value::Type::Symbol || at.symbol_id() != n) {
+			return false;
+		}
+
+		// Only already produced elements can be referenced
+		if (offset < 0 || std::size_t(offset) >= rec.coefficients.size())
+			return false;
+		rec.coefficients[offset] += scale;
+		rec.references.push_back(list[2]);
+		return true;
+	}
+
+	if (is_intrinsic(ctx, head, "+") || is_intrinsic(ctx, head, "-")) {
+		auto const sign = is_intrinsic(ctx, head, "+") ? 1 : -1;
+		for (auto arg = list.begin() + 1; arg != list.end(); ++arg)
+			if (!add_linear_form(ctx, rec, *arg, arg == list.begin() + 1 ? scale : sign * scale))
+				return false;
+		return true;
+	}
+
+	if (is_intrinsic(ctx, head, "*")) {
+		// All factors except one must be integer constants
+		Value const* variable = nullptr;
+		for (auto arg = list.begin() + 1; arg != list.end(); ++arg) {
+			if (arg->type == Value::Type::Int)
+				scale *= arg->ival;
+			else if (!variable)
+				variable = &*arg;
+			else
+				return false;
+		}
+		return variable ? add_linear_form(ctx, rec, *variable, scale) : add_linear_form(ctx, rec, Value::integer(1), scale);
+	}
+
+	return false;
+}
+
+std::shared_ptr<Recurrence_Generator> Recurrence_Generator::recognize(Context &ctx, std::shared_ptr<Composed_Generator> const& composed)
+{
+	assert(composed->children.size() == 2);
+	auto const circular = dynamic_cast<Circular_Generator const*>(composed->children[0].get());
+	auto const dynamic = dynamic_cast<Dynamic_Generator const*>(composed->children[1].get());
+	assert(circular && dynamic);
+
+	auto rec = std::make_shared<Recurrence_Generator>();
+	for (auto const& value : circular->value_set.list()) {
+		if (value.type != Value::Type::Int)
+			return nullptr;
+		rec->initial.push_back(value.ival);
+	}
+	rec->coefficients.resize(rec->initial.size());
+
+	if (rec->initial.empty() || !add_linear_form(ctx, *rec, dynamic->expr, 1) || rec->references.empty())
+		return nullptr;
+
+	rec->general = composed;
+	return rec;
+}
+
+bool Recurrence_Generator::is_self_referential(Context &ctx) const
+{
+	return std::ranges::all_of(references, [&](Value const& symbol) {
+		auto const resolved = ctx[symbol];
+		return resolved && resolved->type == Value::Type::Sequence && resolved->sequence().get() == origin;
+	});
+}
+
+// Elements n, n + 1, ... n + order - 1, computed by raising companion matrix of recurrence
+// to power n. Arithmetic wraps around like in the general evaluation
+std::vector<int64_t> Recurrence_Generator::window(int64_t n) const
+{
+	using Matrix = std::vector<std::vector<uint64_t>>;
+	auto const size = initial.size() + 1; // last row and column carry constant term
+
+	auto const multiply = [size](Matrix const& a, Matrix const& b) {
+		Matrix c(size, std::vector<uint64_t>(size));
+		for (auto i = 0u; i < size; ++i)
+			for (auto k = 0u; k < size; ++k)
+				if (a[i][k] != 0)
+					for (auto j = 0u; j < size; ++j)
+						c[i][j] += a[i][k] * b[k][j];
+		return c;
+	};
+
+	Matrix step(size, std::vector<uint64_t>(size)), power(size, std::vector<uint64_t>(size));
+	for (auto i = 0u; i + 2 < size; ++i)
+		step[i][i + 1] = 1;
+	for (auto k = 0u; k + 1 < size; ++k)
+		step[size - 2][k] = coefficients[k];
+	step[size - 2][size - 1] = constant;
+	step[size - 1][size - 1] = 1;
+
+	for (auto i = 0u; i < size; ++i)
+		power[i][i] = 1;
+	for (; n > 0; n >>= 1) {
+		if (n & 1)
+			power = multiply(power, step);
+		step = multiply(step, step);
+	}
+
+	std::vector<int64_t> result(initial.size());
+	for (auto i = 0u; i < initial.size(); ++i) {
+		uint64_t sum = power[i][size - 1];
+		for (auto k = 0u; k < initial.size(); ++k)
+			sum += power[i][k] * uint64_t(initial[k]);
+		result[i] = int64_t(sum);
+	}
+	return result;
+}
+
+// Elements are produced by single sweep that keeps only last order elements
+struct Recurrence_Cursor : Cursor
+{
+	Recurrence_Generator &rec;
+	std::vector<int64_t> window = {};
+	std::unique_ptr<Cursor> general = nullptr;
+
+	Recurrence_Cursor(Recurrence_Generator &rec) : rec(rec) {}
+
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		if (window.empty() && !general) {
+			if (rec.is_self_referential(ctx)) {
+				window = rec.window(rec.start);
 			} else {
-				return gen->index(ctx, n);
+				general = rec.general->cursor();
+				std::vector<Value> skipped;
+				for (auto left = rec.start; left > 0; left -= skipped.size(), skipped.clear())
+					general->next(ctx, skipped, std::min<std::size_t>(left, Sequence::Chunk_Size));
 			}
 		}
+
+		if (general)
+			return general->next(ctx, chunk, n);
+
+		for (auto i = 0u; i < n; ++i) {
+			chunk.push_back(Value::integer(window.front()));
+			uint64_t next = rec.constant;
+			for (auto k = 0u; k < window.size(); ++k)
+				next += uint64_t(rec.coefficients[k]) * uint64_t(window[k]);
+			std::shift_left(window.begin(), window.end(), 1);
+			window.back() = int64_t(next);
+		}
+		return n;
 	}
+};
+
+std::unique_ptr<Cursor> Recurrence_Generator::cursor()
+{
+	return std::make_unique<Recurrence_Cursor>(*this);
 }
 
-Value Composed_Generator::len(Context &ctx)
+Value Recurrence_Generator::index(Context &ctx, unsigned n)
 {
-	auto sum = Value::integer(0);
-	for (auto const& gen : children)
-		if (auto r = gen->len(ctx); r.type == Value::Type::Nil)
-			return Value::nil();
-		else
-			sum += r;
-	return sum;
+	if (is_self_referential(ctx))
+		return Value::integer(window(start + n).front());
+	return general->index(ctx, start + n);
 }
 
-Value Composed_Generator::pop(Context &, unsigned)
+Value Recurrence_Generator::len(Context &)
 {
-	assert(false && "unimplemented");
+	return Value::nil();
 }
 
+Value Recurrence_Generator::pop(Context &, unsigned n)
+{
+	auto copy = std::make_shared<Recurrence_Generator>(*this);
+	copy->start += n;
+	return Value(std::move(copy));
+}
+
+struct Value_Cursor : Cursor
+{
+	Value_Sequence &seq;
+	std::size_t i = 0;
+	std::unique_ptr<Cursor> nested = nullptr;
+
+	Value_Cursor(Value_Sequence &seq) : seq(seq) {}
+
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		auto const& expr = seq.expr;
+		std::size_t pulled = 0;
+
+		switch (expr.type) {
+		case Value::Type::List:
+			for (; i < expr.list().size() && pulled < n; ++i, ++pulled)
+				chunk.push_back(expr.list()[i]);
+			return pulled;
+
+		case Value::Type::String:
+			for (; i < expr.sval().size() && pulled < n; ++i, ++pulled)
+				chunk.push_back(Value::integer(expr.sval()[i]));
+			return pulled;
+
+		case Value::Type::Int_Vector:
+			for (; i < expr.ints().size() && pulled < n; ++i, ++pulled)
+				chunk.push_back(Value::integer(expr.ints()[i]));
+			return pulled;
+
+		case Value::Type::Sequence:
+			if (!nested)
+				nested = expr.sequence()->cursor();
+			return nested->next(ctx, chunk, n);
+
+		default:
+			return 0;
+		}
+	}
+};
+
+std::unique_ptr<Cursor> Value_Sequence::cursor()
+{
+	return std::make_unique<Value_Cursor>(*this);
+}
 
 Value Value_Sequence::index(Context &ctx, unsigned n)
 {
@@ -178,6 +654,56 @@ Value Value_Sequence::pop(Context &, unsigned)
 	assert(false && "unimplemented");
 }
 
+struct Input_Cursor : Cursor
+{
+	std::vector<int64_t> ints = {};
+
+	std::size_t next(Context &, std::vector<Value> &chunk, std::size_t n) override
+	{
+		ints.clear();
+		auto const pulled = read_ints(ints, n);
+		for (auto i : ints)
+			chunk.push_back(Value::integer(i));
+		return pulled;
+	}
+};
+
+std::unique_ptr<Cursor> Input_Sequence::cursor()
+{
+	return std::make_unique<Input_Cursor>();
+}
+
+// Elements before n-th one are read and dropped
+Value Input_Sequence::index(Context &, unsigned n)
+{
+	std::vector<int64_t> ints;
+	ints.reserve(n + 1);
+	if (read_ints(ints, n + 1) <= n)
+		return Value::nil();
+	return Value::integer(ints.back());
+}
+
+Value Input_Sequence::take(Context &, unsigned n)
+{
+	std::vector<int64_t> ints;
+	ints.reserve(std::min<std::size_t>(n, Chunk_Size * Chunk_Size));
+	read_ints(ints, n);
+	return Value::int_vector(std::move(ints));
+}
+
+Value Input_Sequence::len(Context &)
+{
+	return Value::nil();
+}
+
+Value Input_Sequence::pop(Context &, unsigned n)
+{
+	std::vector<int64_t> ints;
+	for (std::size_t left = n; left > 0 && read_ints(ints, std::min<std::size_t>(left, Chunk_Size)) > 0; ints.clear())
+		left -= ints.size();
+	return Value(std::make_shared<Input_Sequence>());
+}
+
 #if 0
 struct Zip_Sequence : Sequence
 {
@@ -187,38 +713,50 @@ struct Zip_Sequence : Sequence
 
 Value Zip_Sequence::index(Context &ctx, unsigned n)
 {
-	Value list;
-	list.type = Value::Type::List;
+	Value list(Value::Type::List);
 	for (auto &seq : children) {
-		list.list.push_back(seq->index(ctx, n));
+		list.mutable_list().push_back(seq->index(ctx, n));
 	}
 	return zipper(ctx, list);
 }
 
-Value Zip_Sequence::take(Context &ctx, unsigned n)
+// Children are pulled in lockstep, one chunk at a time
+struct Zip_Cursor : Cursor
 {
-	Value list;
-	list.type = Value::Type::List;
-
-	std::vector<Value> takes;
-	for (auto &seq : children) {
-		takes.push_back(seq->take(ctx, n));
+	Zip_Sequence &zip;
+	std::vector<std::unique_ptr<Cursor>> children;
+	std::vector<std::vector<Value>> chunks;
+
+	Zip_Cursor(Zip_Sequence &zip) : zip(zip), chunks(zip.children.size())
+	{
+		for (auto &seq : zip.children)
+			children.push_back(seq->cursor());
 	}
 
-	for (unsigned i = 0; i < n; ++i) {
-		Value frame;
-		frame.type = Value::Type::List;
+	std::size_t next(Context &ctx, std::vector<Value> &chunk, std::size_t n) override
+	{
+		if (children.empty())
+			return 0;
 
-		for (auto &take : takes) {
-			if (take.list.size() > i)
-				return list;
-			frame.list.push_back(take.at(i));
+		auto zipped = n;
+		for (auto i = 0u; i < children.size(); ++i) {
+			chunks[i].clear();
+			zipped = std::min(zipped, children[i]->next(ctx, chunks[i], zipped));
 		}
 
-		list.list.push_back(zipper(ctx, frame));
+		for (auto k = 0u; k < zipped; ++k) {
+			Value frame(Value::Type::List);
+			for (auto &values : chunks)
+				frame.mutable_list().push_back(std::move(values[k]));
+			chunk.push_back(zip.zipper(ctx, std::move(frame)));
+		}
+		return zipped;
 	}
+};
 
-	return list;
+std::unique_ptr<Cursor> Zip_Sequence::cursor()
+{
+	return std::make_unique<Zip_Cursor>(*this);
 }
 
 Value Zip_Sequence::len(Context &)
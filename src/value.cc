@@ -1,26 +1,338 @@
 #include "patty.hh"
 
 #include <charconv>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include <unistd.h>
+
+struct Symbol_Table
+{
+	std::deque<std::string> names; // deque keeps names in place, so ids can refer to them
+	std::unordered_map<std::string_view, Symbol_Id> ids;
+	std::mutex mutex;
+};
+
+static Symbol_Table& symbol_table()
+{
+	static Symbol_Table table;
+	return table;
+}
+
+Symbol_Id intern(std::string_view name)
+{
+	auto &table = symbol_table();
+	std::lock_guard lock(table.mutex);
+	if (auto it = table.ids.find(name); it != table.ids.end())
+		return it->second;
+
+	auto const id = Symbol_Id(table.names.size());
+	table.ids.emplace(table.names.emplace_back(name), id);
+	return id;
+}
+
+std::string const& symbol_name(Symbol_Id id)
+{
+	auto &table = symbol_table();
+	std::lock_guard lock(table.mutex);
+	auto const& names = table.names;
+	assert(id < names.size());
+	return names[id];
+}
+
+Value::Value(Type type)
+	: type(type)
+{
+	switch (type) {
+	case Type::Nil:
+	case Type::Int:
+	case Type::Symbol:
+	case Type::Cpp_Function:
+		return;
+	case Type::String:       object = new Box<std::string>{};               return;
+	case Type::List:         object = new Box<List>{};                      return;
+	case Type::Sequence:     object = new Box<std::shared_ptr<Sequence>>{}; return;
+	case Type::Int_Vector:   object = new Box<std::vector<std::int64_t>>{};  return;
+	case Type::Memo_Function: object = new Box<Memo_Function>{};            return;
+	}
+}
+
+Value::Value(List list)
+	: Value(Type::List)
+{
+	static_cast<Box<List>*>(object)->value = std::move(list);
+}
+
+Value::Value(std::shared_ptr<Sequence> sequence)
+	: Value(Type::Sequence)
+{
+	static_cast<Box<std::shared_ptr<Sequence>>*>(object)->value = std::move(sequence);
+}
+
+Value Value::string(std::string_view src)
+{
+	Value value(Type::String);
+	static_cast<Box<std::string>*>(value.object)->value = src;
+	return value;
+}
+
+Value Value::int_vector(std::vector<std::int64_t> ints)
+{
+	Value value(Type::Int_Vector);
+	static_cast<Box<std::vector<std::int64_t>>*>(value.object)->value = std::move(ints);
+	return value;
+}
+
+Value Value::symbol(std::string_view src)
+{
+	Value value(Type::Symbol);
+	value.ival = intern(src);
+	return value;
+}
+
+Value Value::cpp(char const *name, Intrinsic::Function function)
+{
+	auto index = Intrinsic::find(name);
+	if (index == Intrinsic::Not_Found) {
+		index = Intrinsic::table.size();
+		Intrinsic::table.push_back({ name, function });
+	}
+	assert(Intrinsic::table[index].function == function);
+
+	Value value(Type::Cpp_Function);
+	value.ival = index;
+	return value;
+}
+
+unsigned Intrinsic::find(std::string_view name)
+{
+	auto const it = std::ranges::find(table, name, &Intrinsic::name);
+	return it == table.end() ? Not_Found : unsigned(std::distance(table.begin(), it));
+}
+
+std::string const& Value::sval() const
+{
+	static std::string const empty;
+
+	switch (type) {
+	case Type::String:       return static_cast<Box<std::string>*>(object)->value;
+	case Type::Symbol:       return symbol_name(symbol_id());
+	case Type::Cpp_Function: return intrinsic().name;
+	default:                 return empty;
+	}
+}
+
+// Lists are shared between copies, so detach before first modification
+Value::List& Value::mutable_list()
+{
+	if (type == Type::Int_Vector) {
+		// Elements may be replaced by any values, so int vector stops being one
+		Value degraded = as_list();
+		degraded.address = address;
+		swap(degraded);
+	}
+
+	assert(type == Type::List);
+	if (object->references.load(std::memory_order_acquire) > 1) {
+		// Shared payload is released by detached value, like any other copy
+		Value detached(list());
+		detached.address = address;
+		swap(detached);
+	}
+	return static_cast<Box<List>*>(object)->value;
+}
+
+std::vector<std::int64_t>& Value::mutable_ints()
+{
+	assert(type == Type::Int_Vector);
+	if (object->references.load(std::memory_order_acquire) > 1) {
+		Value detached = int_vector(ints());
+		detached.address = address;
+		swap(detached);
+	}
+	return static_cast<Box<std::vector<std::int64_t>>*>(object)->value;
+}
+
+Value Value::as_list() const
+{
+	if (type != Type::Int_Vector)
+		return *this;
+
+	Value result(Type::List);
+	auto &list = result.mutable_list();
+	for (auto i : ints())
+		list.push_back(Value::integer(i));
+	return result;
+}
+
+void Value::List::detach()
+{
+	if (storage && storage.use_count() > 1) {
+		copies.fetch_add(1, std::memory_order_relaxed);
+		storage = make_storage(storage->begin() + offset, storage->begin() + offset + count);
+		offset = 0;
+	}
+}
+
+// Other lists may share storage only up to their own end, so if this one ends where
+// storage ends it can grow in place, as long as elements seen by others are not moved
+void Value::List::reserve_back()
+{
+	if (storage && offset + count == storage->size()
+			&& (storage.use_count() == 1 || (grow_shared && storage->size() < storage->capacity())))
+		return;
+
+	auto grown = make_storage();
+	grown->reserve(std::max<std::size_t>(2 * count, 4));
+	if (storage && storage.use_count() == 1) {
+		grown->insert(grown->end(), std::make_move_iterator(storage->begin() + offset), std::make_move_iterator(storage->begin() + offset + count));
+	} else if (storage) {
+		copies.fetch_add(1, std::memory_order_relaxed);
+		grown->insert(grown->end(), storage->begin() + offset, storage->begin() + offset + count);
+	}
+	storage = std::move(grown);
+	offset = 0;
+}
+
+void Value::List::push_front(Value value)
+{
+	auto grown = make_storage();
+	grown->reserve(count + 1);
+	if (count > 0)
+		copies.fetch_add(1, std::memory_order_relaxed);
+	grown->push_back(std::move(value));
+	grown->insert(grown->end(), std::as_const(*this).begin(), std::as_const(*this).end());
+	storage = std::move(grown);
+	offset = 0;
+	++count;
+}
+
+void Value::List::append(List const& other)
+{
+	if (empty()) {
+		*this = other;
+		return;
+	}
+
+	// Copy slice first, since other may share storage with this list
+	auto const source = other.storage;
+	auto const from = other.offset, n = other.count;
+	for (auto i = 0u; i < n; ++i)
+		push_back((*source)[from + i]);
+}
+
+void Value::release()
+{
+	if (object->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	switch (type) {
+	case Type::Nil:
+	case Type::Int:
+	case Type::Symbol:
+	case Type::Cpp_Function:
+		return;
+	case Type::String:       delete static_cast<Box<std::string>*>(object);               return;
+	case Type::List:         delete static_cast<Box<List>*>(object);                      return;
+	case Type::Sequence:     delete static_cast<Box<std::shared_ptr<Sequence>>*>(object); return;
+	case Type::Int_Vector:   delete static_cast<Box<std::vector<std::int64_t>>*>(object);  return;
+	case Type::Memo_Function: delete static_cast<Box<Memo_Function>*>(object);            return;
+	}
+}
 
 bool Value::operator==(Value const& other) const
 {
-	if (type != other.type)
+	if (type != other.type) {
+		// The same list may be stored either way
+		if (type == Type::Int_Vector && other.type == Type::List)
+			return as_list() == other;
+		if (type == Type::List && other.type == Type::Int_Vector)
+			return *this == other.as_list();
 		return false;
+	}
 
 	switch (type) {
 	case Type::Nil: return true;
-	case Type::Int: return ival == other.ival;
-	case Type::Cpp_Function: return (!sval.empty() && !other.sval.empty()) && sval == other.sval;
-	case Type::Symbol:
-	case Type::String: return sval == other.sval;
-	case Type::List: return std::equal(CR(list), CR(other.list));
+	case Type::Int:
+	case Type::Symbol: return ival == other.ival;
+	case Type::Cpp_Function: return ival == other.ival;
+	case Type::String: return sval() == other.sval();
+	case Type::List: return object == other.object || std::ranges::equal(list(), other.list());
 	case Type::Sequence: return false;
+	case Type::Int_Vector: return object == other.object || ints() == other.ints();
+	case Type::Memo_Function: return object == other.object;
 	}
 
 	return false;
 }
 
+std::size_t Value::hash() const
+{
+	constexpr std::uint64_t Multiplier = 0x9e3779b97f4a7c15ULL;
+	auto const mix = [](std::uint64_t hash, std::uint64_t word) {
+		hash = (hash ^ word) * Multiplier;
+		return hash ^ (hash >> 29);
+	};
+
+	switch (type) {
+	case Type::Nil:          return 0;
+	case Type::Int:          return mix(std::uint64_t(Type::Int), ival);
+	case Type::Symbol:       return mix(std::uint64_t(Type::Symbol), ival);
+	case Type::Cpp_Function: return mix(std::uint64_t(Type::Cpp_Function), ival);
+	case Type::String:       return std::hash<std::string>{}(sval());
+
+	// Elements of int vector are hashed like integer values, so it matches equal list
+	case Type::List:
+		{
+			std::uint64_t hash = std::uint64_t(Type::List);
+			for (auto const& el : list())
+				hash = mix(hash, el.hash());
+			return hash;
+		}
+	case Type::Int_Vector:
+		{
+			std::uint64_t hash = std::uint64_t(Type::List);
+			for (auto i : ints())
+				hash = mix(hash, mix(std::uint64_t(Type::Int), i));
+			return hash;
+		}
+
+	// Compared by identity
+	case Type::Sequence:
+	case Type::Memo_Function:
+		return std::hash<Object*>{}(object);
+	}
+
+	return 0;
+}
+
+std::optional<Value> Memo_Function::find(Value const& args)
+{
+	auto const it = index.find(args);
+	if (it == index.end())
+		return std::nullopt;
+	if (!parallel_section)
+		entries.splice(entries.begin(), entries, it->second);
+	return it->second->second;
+}
+
+void Memo_Function::insert(Value args, Value result)
+{
+	// Recursive call with the same arguments could already store result
+	if (parallel_section || capacity == 0 || index.contains(args))
+		return;
+
+	if (entries.size() == capacity) {
+		index.erase(entries.back().first);
+		entries.pop_back();
+	}
+	entries.emplace_front(std::move(args), std::move(result));
+	index.emplace(entries.front().first, entries.begin());
+}
+
 bool Value::operator!=(Value const& other) const
 {
 	return !(*this == other);
@@ -28,36 +340,209 @@ bool Value::operator!=(Value const& other) const
 
 bool Value::is_static_expression(Context &ctx) const
 {
+	static auto const n = intern("n"), zip_with = intern("zip-with"), tail = intern("tail");
+
 	switch (type) {
 	case Type::List:
-		if (!list.empty() && list.front().type == Type::Symbol) {
-			for (auto name : { "zip-with", "tail" }) {
-				if (name == list.front().sval)
+		if (!list().empty() && list().front().type == Type::Symbol) {
+			for (auto name : { zip_with, tail }) {
+				if (name == list().front().symbol_id())
 					return false;
 			}
 		}
-		return std::ranges::all_of(list, [&](auto const& val) { return val.is_static_expression(ctx); });
+		return std::ranges::all_of(list(), [&](auto const& val) { return val.is_static_expression(ctx); });
 	case Type::Symbol:
-		return sval != "n";
+		return symbol_id() != n;
 	default:
 		return true;
 	}
 }
 
+// Intrinsics that evaluate all of their arguments right away in scope they were called from.
+// Others (like fun or seq) evaluate them later, so addresses could point to different scopes
+static constexpr auto Eager_Intrinsics = std::array {
+	"+"sv, "-"sv, "*"sv, "=="sv, "!="sv, "<"sv, "<="sv, ">"sv, ">="sv,
+	"do"sv, "print"sv, "if"sv, "++"sv, "len"sv, "index"sv, "take"sv, "tail"sv, "fold"sv, "loop"sv, "pop"sv, "zip"sv, "memo"sv
+};
+
+void Value::resolve(Context &ctx, Lexical_Scopes &lexical)
+{
+	switch (type) {
+	case Type::Symbol:
+		address = ctx.address(symbol_id(), lexical);
+		return;
+
+	case Type::List:
+		{
+			if (list().empty())
+				return;
+
+			auto &list = mutable_list();
+			auto &head = list.front();
+			head.resolve(ctx, lexical);
+			if (head.type != Type::Symbol || head.address.kind != Address::Kind::Global)
+				return;
+
+			auto const& callee = ctx.globals[head.address.slot];
+			if (callee.defined && callee.value.type == Type::Cpp_Function) {
+				auto const& name = callee.value.sval();
+				if (name == "def" && list.size() >= 3) {
+					at(2).resolve(ctx, lexical);
+				} else if (name == "for" && list.size() >= 4) {
+					at(2).resolve(ctx, lexical);
+					auto &scope = lexical.scopes.emplace_back();
+					for (auto const& pattern : at(1).type == Type::List ? at(1).list() : List{at(1)})
+						if (pattern.type == Type::Symbol && std::find(R(scope), pattern.symbol_id()) == scope.end())
+							scope.push_back(pattern.symbol_id());
+					at(3).resolve(ctx, lexical);
+					lexical.scopes.pop_back();
+				} else if (std::find(R(Eager_Intrinsics), name) != Eager_Intrinsics.end()) {
+					for (auto &arg : tail())
+						arg.resolve(ctx, lexical);
+				}
+				return;
+			}
+
+			// User functions (also not defined yet) have arguments evaluated in scope of the caller
+			if (!callee.defined || callee.value.type == Type::List || callee.value.type == Type::Memo_Function) {
+				for (auto &arg : tail())
+					arg.resolve(ctx, lexical);
+			}
+		}
+		return;
+
+	default:
+		return;
+	}
+}
+
+static void collect_definitions(Value const& value, std::vector<Symbol_Id> &names)
+{
+	static auto const def = intern("def"), defmemo = intern("defmemo");
+
+	if (value.type != Value::Type::List)
+		return;
+
+	auto const& list = value.list();
+	if (list.size() >= 2 && list.front().type == Value::Type::Symbol && (list.front().symbol_id() == def || list.front().symbol_id() == defmemo)
+			&& value.at(1).type == Value::Type::Symbol)
+		names.push_back(value.at(1).symbol_id());
+
+	for (auto const& el : list)
+		collect_definitions(el, names);
+}
+
+void resolve(Context &ctx, Value &body, std::vector<Symbol_Id> const& names)
+{
+	Lexical_Scopes lexical;
+	auto &scope = lexical.scopes.emplace_back();
+	for (auto const& name : names)
+		if (std::find(R(scope), name) == scope.end())
+			scope.push_back(name);
+
+	collect_definitions(body, lexical.unstable);
+	body.resolve(ctx, lexical);
+}
+
+void resolve_function(Context &ctx, Value &function)
+{
+	if (function.list().size() < 2 || function.list().front().type != Value::Type::List)
+		return;
+
+	std::vector<Symbol_Id> names;
+	for (auto const& param : function.list().front().list())
+		if (param.type == Value::Type::Symbol)
+			names.push_back(param.symbol_id());
+	resolve(ctx, function.at(1), names);
+}
+
+bool constant_folding = true;
+
+// Intrinsics without side effects that are evaluated while folding when all arguments are integers
+static constexpr auto Foldable_Intrinsics = std::array {
+	"+"sv, "-"sv, "*"sv, "=="sv, "!="sv, "<"sv, "<="sv, ">"sv, ">="sv
+};
+
+bool is_literal(Value const& value)
+{
+	switch (value.type) {
+	case Value::Type::Int:
+	case Value::Type::String:
+	case Value::Type::Int_Vector:
+		return true;
+	case Value::Type::List:
+		// List evaluates to itself when its head is not callable
+		return !value.list().empty() && (value.list().front().type == Value::Type::Int || value.list().front().type == Value::Type::String);
+	default:
+		return false;
+	}
+}
+
+// Walks the same parts of expression as resolution pass does, so forms that are data
+// (like arguments of list) or evaluated later (like body of fun) are not changed.
+// Only top-level forms are folded: callee inside fun or seq body may be rebound by caller
+// that runs it, since scoping is dynamic
+void fold_constants(Context &ctx, Value &value)
+{
+	if (value.type != Value::Type::List || value.list().empty())
+		return;
+
+	auto const& head = value.list().front();
+	if (head.type != Value::Type::Symbol || head.address.kind != Value::Address::Kind::Global)
+		return;
+
+	auto const& callee = ctx.globals[head.address.slot];
+	if (!callee.defined || callee.value.type != Value::Type::Cpp_Function) {
+		// User functions (also not defined yet) have arguments evaluated by the caller
+		if (!callee.defined || callee.value.type == Value::Type::List || callee.value.type == Value::Type::Memo_Function)
+			for (auto &arg : value.tail())
+				fold_constants(ctx, arg);
+		return;
+	}
+
+	// Builtin hidden by local is resolved at runtime
+	if (callee.shadowed != 0)
+		return;
+
+	auto const& name = callee.value.sval();
+	if (name == "def" && value.list().size() >= 3) {
+		fold_constants(ctx, value.at(2));
+	} else if (name == "for" && value.list().size() >= 4) {
+		fold_constants(ctx, value.at(2));
+		fold_constants(ctx, value.at(3));
+	} else if (name == "list") {
+		// Arguments are not evaluated, so they are already the resulting list
+		auto args = value.list();
+		args.pop_front();
+		if (Value literal(std::move(args)); is_literal(literal))
+			value = std::move(literal);
+	} else if (std::find(R(Eager_Intrinsics), name) != Eager_Intrinsics.end()) {
+		for (auto &arg : value.tail())
+			fold_constants(ctx, arg);
+
+		if (value.list().size() >= 2 && std::find(R(Foldable_Intrinsics), name) != Foldable_Intrinsics.end()
+				&& std::ranges::all_of(std::as_const(value).tail(), [](Value const& arg) { return arg.type == Value::Type::Int; }))
+			value = eval(ctx, value);
+	}
+}
+
 std::optional<uint64_t> Value::size(Context &ctx) const
 {
 	switch (type) {
 	case Value::Type::List:
-		return list.size();
+		return list().size();
+
+	case Value::Type::Int_Vector:
+		return ints().size();
 
 	case Value::Type::Sequence:
 		{
-			auto len = sequence->len(ctx);
+			auto len = sequence()->len(ctx);
 			return len.type == Type::Int ? std::optional<uint64_t>(len.ival) : std::nullopt;
 		}
 
 	case Value::Type::String:
-		return sval.size();
+		return sval().size();
 
 	default:
 		return std::nullopt;
@@ -70,11 +555,15 @@ Value Value::index(Context &ctx, unsigned n)
 	case Value::Type::List:
 		return at(n);
 
+	case Value::Type::Int_Vector:
+		assert(n < ints().size());
+		return Value::integer(ints()[n]);
+
 	case Value::Type::Sequence:
-		return sequence->index(ctx, n);
+		return sequence()->index(ctx, n);
 
 	case Value::Type::String:
-		return Value::integer(sval[n]);
+		return Value::integer(sval()[n]);
 
 	default:
 		return Value::nil();
@@ -85,12 +574,12 @@ void Value::subst(Context &ctx)
 {
 	switch (type) {
 	case Type::List:
-		for (auto &el : list)
+		for (auto &el : mutable_list())
 			el.subst(ctx);
 		break;
 
 	case Type::Symbol:
-		if (auto v = ctx[sval]; v)
+		if (auto v = ctx[symbol_id()]; v)
 			*this = *v;
 		break;
 
@@ -103,21 +592,24 @@ Value Value::take(Context &ctx, uint64_t n)
 {
 	switch (type) {
 	case Type::String:
-		return Value::string(std::string_view(sval).substr(0, n));
+		return Value::string(std::string_view(sval()).substr(0, n));
 
 	case Type::List:
 		{
-			auto to_remove = int64_t(list.size()) - int64_t(n);
-			if (to_remove < 0)
-				return *this;
-			list.erase(std::next(list.begin(), n), list.end());
+			if (n < list().size())
+				mutable_list().truncate(n);
 			return *this;
 		}
 
+	case Type::Int_Vector:
+		if (n < ints().size())
+			mutable_ints().resize(n);
+		return *this;
+
 	case Type::Sequence:
 		{
-			assert(sequence);
-			return Sequence::take(*sequence, ctx, n);
+			assert(sequence());
+			return Sequence::take(*sequence(), ctx, n);
 		}
 
 	default:
@@ -130,11 +622,13 @@ bool Value::coarce_bool() const
 	switch (type) {
 	case Type::Sequence:
 	case Type::Symbol:
-	case Type::Cpp_Function: return true;
+	case Type::Cpp_Function:
+	case Type::Memo_Function: return true;
 	case Type::Nil: return false;
 	case Type::Int: return ival != 0;
-	case Type::List: return !list.empty();
-	case Type::String: return !sval.empty();
+	case Type::List: return !list().empty();
+	case Type::Int_Vector: return !ints().empty();
+	case Type::String: return !sval().empty();
 	}
 
 	return false;
@@ -142,154 +636,492 @@ bool Value::coarce_bool() const
 
 Value& Value::at(unsigned index) &
 {
-	return *std::next(list.begin(), index);
+	return mutable_list()[index];
 }
 
 Value&& Value::at(unsigned index) &&
 {
-	return std::move(*std::next(list.begin(), index));
+	return std::move(mutable_list()[index]);
+}
+
+Value const& Value::at(unsigned index) const&
+{
+	return list()[index];
+}
+
+// Integer operand is combined with every element of int vector. Int vectors of different
+// length are combined up to the shorter one, like in zip-with. Loops are simple enough
+// to be vectorized by the compiler
+template<typename Op>
+static void elementwise(Value &lhs, Value const& rhs)
+{
+	assert(lhs.type == Value::Type::Int || lhs.type == Value::Type::Int_Vector);
+	assert(rhs.type == Value::Type::Int || rhs.type == Value::Type::Int_Vector);
+
+	if (lhs.type == Value::Type::Int) {
+		if (rhs.type == Value::Type::Int) {
+			lhs.ival = Op{}(lhs.ival, rhs.ival);
+			return;
+		}
+
+		auto const scalar = lhs.ival;
+		auto const& ints = rhs.ints();
+		std::vector<std::int64_t> result(ints.size());
+		for (std::size_t i = 0; i < result.size(); ++i)
+			result[i] = Op{}(scalar, ints[i]);
+		lhs = Value::int_vector(std::move(result));
+		return;
+	}
+
+	auto &ints = lhs.mutable_ints();
+	if (rhs.type == Value::Type::Int) {
+		auto const scalar = rhs.ival;
+		for (auto &i : ints)
+			i = Op{}(i, scalar);
+		return;
+	}
+
+	auto const& other = rhs.ints();
+	ints.resize(std::min(ints.size(), other.size()));
+	for (std::size_t i = 0; i < ints.size(); ++i)
+		ints[i] = Op{}(ints[i], other[i]);
 }
 
 void Value::operator+=(Value const& other)
 {
-	assert(type == Type::Int);
-	assert(other.type == Type::Int);
-	ival += other.ival;
+	elementwise<std::plus<std::int64_t>>(*this, other);
 }
 
 void Value::operator-=(Value const& other)
 {
-	assert(type == Type::Int);
-	assert(other.type == Type::Int);
-	ival -= other.ival;
+	elementwise<std::minus<std::int64_t>>(*this, other);
 }
 
 void Value::operator*=(Value const& other)
 {
-	assert(type == Type::Int);
-	assert(other.type == Type::Int);
-	ival *= other.ival;
+	elementwise<std::multiplies<std::int64_t>>(*this, other);
+}
+
+bool line_buffered = false;
+
+namespace
+{
+	struct Output
+	{
+		static constexpr std::size_t Capacity = 1 << 16;
+		fmt::memory_buffer buffer;
+
+		// Writes buffer directly to file descriptor, so destructor doesn't go through output()
+		// while function-local static is destroyed
+		void flush()
+		{
+			std::fflush(stdout);
+			for (std::size_t written = 0; written < buffer.size();) {
+				auto const n = ::write(STDOUT_FILENO, buffer.data() + written, buffer.size() - written);
+				if (n <= 0)
+					break;
+				written += n;
+			}
+			buffer.clear();
+		}
+
+		~Output() { flush(); }
+	};
+}
+
+static Output& output()
+{
+	static Output output;
+	return output;
+}
+
+fmt::memory_buffer& output_buffer()
+{
+	return output().buffer;
+}
+
+void output_written()
+{
+	if (line_buffered || output().buffer.size() >= Output::Capacity)
+		flush_output();
+}
+
+void flush_output()
+{
+	output().flush();
+}
+
+namespace
+{
+	struct Input
+	{
+		std::size_t capacity = 1 << 20;
+		std::unique_ptr<char[]> buffer = std::make_unique<char[]>(capacity);
+		std::size_t begin = 0, end = 0;
+		bool eof = false;
+
+		// Input is read directly from descriptor, bypassing reader of program
+		Input()
+		{
+			if (filename == "-")
+				error_fatal("read cannot be used when program is read from standard input");
+		}
+
+		// Keeps unread bytes and appends what is available. Buffer filled by single
+		// token is grown, so token is not cut and the rest of input is not dropped
+		void refill()
+		{
+			std::memmove(buffer.get(), buffer.get() + begin, end - begin);
+			end -= begin;
+			begin = 0;
+			if (end == capacity) {
+				auto grown = std::make_unique<char[]>(capacity * 2);
+				std::memcpy(grown.get(), buffer.get(), end);
+				buffer = std::move(grown);
+				capacity *= 2;
+			}
+			if (auto const n = ::read(STDIN_FILENO, buffer.get() + end, capacity - end); n > 0)
+				end += n;
+			else
+				eof = true;
+		}
+	};
+}
+
+static inline bool is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-';
+}
+
+std::size_t read_ints(std::vector<std::int64_t> &ints, std::size_t n)
+{
+	static Input input;
+
+	std::size_t count = 0;
+	while (count < n) {
+		auto const data = input.buffer.get();
+		for (; input.begin < input.end && !is_number_char(data[input.begin]); ++input.begin) {}
+
+		// Token may continue in input that was not read yet
+		auto token_end = input.begin;
+		for (; token_end < input.end && is_number_char(data[token_end]); ++token_end) {}
+		if (token_end == input.end && !input.eof) {
+			input.refill();
+			continue;
+		}
+		if (input.begin == input.end)
+			break;
+
+		std::int64_t value;
+		auto const [p, ec] = std::from_chars(data + input.begin, data + token_end, value);
+		input.begin = ec == std::errc{} ? p - data : token_end;
+		if (ec == std::errc{}) {
+			ints.push_back(value);
+			++count;
+		}
+	}
+	return count;
 }
 
 void print(Value const& value)
 {
-	fmt::print("{}\n", value);
+	fmt::format_to(fmt::appender(output_buffer()), "{}\n", value);
+	output_written();
+}
+
+// Character classes of reader, looked up in table instead of locale dependent <cctype> calls
+enum Char_Class : std::uint8_t
+{
+	Space        = 1 << 0,
+	Digit        = 1 << 1,
+	Symbol_Start = 1 << 2,
+	Symbol_Char  = 1 << 3,
+};
+
+static constexpr auto Char_Classes = [] {
+	std::array<std::uint8_t, 256> classes{};
+	for (unsigned char c : " \t\n\v\f\r"sv)
+		classes[c] |= Space;
+	for (unsigned char c : "+-*/%$@!^&[]:;<>,.|="sv)
+		classes[c] |= Symbol_Start | Symbol_Char;
+	for (unsigned c = 'a'; c <= 'z'; ++c) {
+		classes[c] |= Symbol_Start | Symbol_Char;
+		classes[c - 'a' + 'A'] |= Symbol_Start | Symbol_Char;
+	}
+	for (unsigned c = '0'; c <= '9'; ++c)
+		classes[c] |= Digit | Symbol_Char;
+	return classes;
+}();
+
+static inline bool is(char c, Char_Class cls)
+{
+	return Char_Classes[static_cast<unsigned char>(c)] & cls;
+}
+
+// High bit set in every byte of word equal to c
+static inline std::uint64_t bytes_equal(std::uint64_t word, char c)
+{
+	constexpr auto Low_Bits = 0x7f7f7f7f7f7f7f7fULL;
+	auto const v = word ^ (0x0101010101010101ULL * static_cast<unsigned char>(c));
+	return ~(((v & Low_Bits) + Low_Bits) | v | Low_Bits);
+}
+
+// Long runs of whitespace (like indentation of generated code) are skipped word at a time
+static void skip_whitespace(std::string_view &source)
+{
+	auto p = source.data();
+	auto const end = p + source.size();
+	for (; end - p >= 8; p += 8) {
+		std::uint64_t word;
+		std::memcpy(&word, p, sizeof(word));
+		auto const spaces = bytes_equal(word, ' ') | bytes_equal(word, '\t') | bytes_equal(word, '\n') | bytes_equal(word, '\r');
+		if (spaces != 0x8080808080808080ULL)
+			break;
+	}
+	for (; p != end && is(*p, Space); ++p) {}
+	source.remove_prefix(p - source.data());
 }
 
 // TODO expose to userspace
 Value read(std::string_view &source)
 {
-	while (!source.empty()) {
-		for (; !source.empty() && std::isspace(source.front()); source.remove_prefix(1)) {}
-		if (source.starts_with('#')) {
-			source.remove_prefix(source.find('\n'));
-		} else {
+	for (;;) {
+		skip_whitespace(source);
+		if (!source.starts_with('#'))
 			break;
-		}
+		auto const newline = static_cast<char const*>(std::memchr(source.data(), '\n', source.size()));
+		source.remove_prefix(newline ? newline - source.data() : source.size());
 	}
 
 	if (source.empty())
 		return Value::nil();
 
 	if (source.starts_with('"')) {
-		auto end = std::adjacent_find(std::cbegin(source)+1, std::cend(source), [](char prev, char curr) {
-			return prev != '\\' && curr == '"';
-		});
+		// Quote preceded by backslash does not end string
+		auto end = source.data();
+		do {
+			end = static_cast<char const*>(std::memchr(end + 1, '"', source.data() + source.size() - end - 1));
+			if (!end)
+				error_fatal("unterminated string literal");
+		} while (end[-1] == '\\');
 
-		auto str = Value::string({ std::cbegin(source) + 1, end + 1 }); // TODO add escaping like \n
-		source.remove_prefix(std::distance(std::cbegin(source), end + 2));
+		auto str = Value::string({ source.data() + 1, end }); // TODO add escaping like \n
+		source.remove_prefix(end + 1 - source.data());
 		return str;
 	}
 
-	if (std::isdigit(source.front()) || (source.front() == '-' && std::isdigit(source[1]))) {
-		auto value = Value();
-		value.type = Value::Type::Int;
-		auto [p, ec] = std::from_chars(&source.front(), &source.back() + 1, value.ival);
-		assert(p != &source.front());
-		source.remove_prefix(p - &source.front());
+	if (is(source.front(), Digit) || (source.front() == '-' && source.size() > 1 && is(source[1], Digit))) {
+		auto value = Value::integer(0);
+		auto [p, ec] = std::from_chars(source.data(), source.data() + source.size(), value.ival);
+		assert(p != source.data());
+		source.remove_prefix(p - source.data());
 		return value;
 	}
 
-	static constexpr std::string_view Valid_Symbol_Char = "+-*/%$@!^&[]:;<>,.|=";
-	if (std::isalpha(source.front()) || Valid_Symbol_Char.find(source.front()) != std::string_view::npos) {
-		auto end = std::find_if(source.cbegin()+1, source.cend(), [](char curr) {
-			return !std::isalnum(curr) && Valid_Symbol_Char.find(curr) == std::string_view::npos;
-		});
-		auto symbol = Value::symbol({ std::cbegin(source), end });
-		source.remove_prefix(std::distance(std::cbegin(source), end));
+	if (is(source.front(), Symbol_Start)) {
+		auto const end = std::find_if(source.cbegin() + 1, source.cend(), [](char c) { return !is(c, Symbol_Char); });
+		auto symbol = Value::symbol({ source.cbegin(), end });
+		source.remove_prefix(std::distance(source.cbegin(), end));
 		return symbol;
 	}
 
 	if (source.starts_with('(')) {
-		Value list, elem;
-		list.type = Value::Type::List;
+		Value list(Value::Type::List), elem;
 		source.remove_prefix(1);
 		while ((elem = read(source)).type != Value::Type::Nil) {
-			list.list.push_back(std::move(elem));
+			list.mutable_list().push_back(std::move(elem));
 		}
 		return list;
 	}
 
-	if (source.starts_with(')')) {
-		source.remove_prefix(1);
-	}
+	if (!source.starts_with(')'))
+		error_fatal("unexpected character '{}'"_format(source.front()));
 
+	source.remove_prefix(1);
 	return Value::nil();
 }
 
-// TODO expose to userspace
-Value eval(Context &ctx, Value value)
+std::optional<std::size_t> form_length(std::string_view source, bool complete)
 {
-	switch (value.type) {
-	case Value::Type::Sequence:
-	case Value::Type::Int:
-	case Value::Type::Nil:
-	case Value::Type::Cpp_Function:
-	case Value::Type::String:
-		return value;
+	std::size_t depth = 0;
+	for (std::size_t i = 0; i < source.size();) {
+		switch (source[i]) {
+		case '#':
+			if (i = source.find('\n', i); i == std::string_view::npos)
+				return complete ? std::optional(source.size()) : std::nullopt;
+			continue;
 
-	case Value::Type::Symbol:
-		if (auto resolved = ctx[value.sval]; resolved) {
-			return *resolved;
-		} else {
-			error_fatal("Cannot resolve symbol {}"_format(value.sval));
+		case '"':
+			do {
+				if (i = source.find('"', i + 1); i == std::string_view::npos)
+					return complete ? std::optional(source.size()) : std::nullopt;
+			} while (source[i - 1] == '\\');
+			++i;
+			break;
+
+		case '(':
+			++i;
+			++depth;
+			continue;
+
+		case ')':
+			++i;
+			if (depth > 0)
+				--depth;
+			break;
+
+		default:
+			if (is(source[i], Space)) {
+				++i;
+				continue;
+			}
+			// Atom ends on first character that cannot continue it, which must be already read
+			for (++i; i < source.size() && is(source[i], Symbol_Char); ++i) {}
+			if (i == source.size() && !complete)
+				return std::nullopt;
 		}
 
-	case Value::Type::List:
-		{
-			// assert(!value.list.empty());
-			if (value.list.empty())
-				return Value::nil();
-
-			auto callable = eval(ctx, value.list.front());
-			switch (callable.type) {
-			case Value::Type::Cpp_Function:
-				value.list.pop_front();
-				return callable.cpp_function(ctx, std::move(value));
-
-			case Value::Type::List:
-				{
-					// Local scope
-					ctx.scopes.emplace_back();
-
-					auto const& formal = callable.list.front();
-					assert(formal.type == Value::Type::List);
-					auto formal_it = formal.list.begin();
-					for (auto arg = std::next(value.list.begin()); arg != value.list.end(); ++arg, ++formal_it) {
-						assert(formal_it->type == Value::Type::Symbol);
-						ctx.assign(formal_it->sval, eval(ctx, std::move(*arg)));
-					}
-					assert(formal_it == formal.list.end()); // TODO not all parameters were provided
-					auto result = eval(ctx, *std::next(callable.list.begin()));
-					ctx.scopes.pop_back();
-					return result;
+		if (depth == 0)
+			return i;
+	}
+	return complete ? std::optional(source.size()) : std::nullopt;
+}
+
+// TODO expose to userspace
+// Calls in tail position (last expression of function body, if or do) are evaluated
+// by next iteration of the loop instead of recursion, so tail recursive functions
+// run in constant native stack.
+// Expressions are borrowed, not copied: expr points into program or into body of
+// function that is kept alive below, so calls do not copy forms they evaluate
+Value eval(Context &ctx, Value const& root)
+{
+	// Intrinsics evaluated by this loop, so their last expression is in tail position
+	static auto const If = Intrinsic::find("if"), Do = Intrinsic::find("do");
+
+	Value const* expr = &root;
+
+	// Function whose body is evaluated by tail call
+	Value function;
+
+	// Scopes of user functions entered by this invocation
+	unsigned frames = 0;
+	auto const leave = [&](Value result) {
+		for (; frames > 0; --frames)
+			ctx.pop_scope();
+		return result;
+	};
+
+	for (;;) {
+		switch (expr->type) {
+		case Value::Type::Sequence:
+		case Value::Type::Int:
+		case Value::Type::Nil:
+		case Value::Type::Cpp_Function:
+		case Value::Type::String:
+		case Value::Type::Int_Vector:
+		case Value::Type::Memo_Function:
+			return leave(*expr);
+
+		case Value::Type::Symbol:
+			if (auto resolved = ctx[*expr]; resolved) {
+				return leave(*resolved);
+			} else {
+				error_fatal("Cannot resolve symbol {}"_format(expr->sval()));
+			}
+
+		case Value::Type::List:
+			{
+				auto const& forms = expr->list();
+				// assert(!forms.empty());
+				if (forms.empty())
+					return leave(Value::nil());
+
+				// Head resolved to slot by resolution pass is read directly
+				Value callable;
+				if (auto const& head = forms.front(); head.type == Value::Type::Symbol) {
+					if (auto resolved = ctx[head]; resolved)
+						callable = *resolved;
+					else
+						error_fatal("Cannot resolve symbol {}"_format(head.sval()));
+				} else {
+					callable = eval(ctx, head);
 				}
 
-			default:
-				return value;
+				switch (callable.type) {
+				case Value::Type::Cpp_Function:
+					if (callable.ival == If && forms.size() >= 3) {
+						if (eval(ctx, forms[1]).coarce_bool())
+							expr = &forms[2];
+						else if (forms.size() > 3)
+							expr = &forms[3];
+						else
+							return leave(Value::nil());
+						continue;
+					} else if (callable.ival == Do && forms.size() >= 2) {
+						for (auto form = std::next(forms.begin()); form != std::prev(forms.end()); ++form)
+							eval(ctx, *form);
+						expr = &forms.back();
+						continue;
+					}
+
+					{
+						// Slice shares elements with the call
+						auto args = forms;
+						args.pop_front();
+						return leave(callable.intrinsic().function(ctx, Value(std::move(args))));
+					}
+
+				case Value::Type::List:
+					{
+						auto const& formal = callable.list().front();
+						assert(formal.type == Value::Type::List);
+						assert(formal.list().size() == forms.size() - 1); // TODO not all parameters were provided
+
+						// Arguments are evaluated in scope of the caller, so their addresses are known before call
+						auto frame = ctx.new_scope();
+						for (auto arg = std::next(forms.begin()); arg != forms.end(); ++arg)
+							frame.values.push_back(eval(ctx, *arg));
+
+						// Scope entered by previous tail call can be dropped only when callee would not see its names
+						if (frames > 0 && ctx.rebinds_all(formal))
+							ctx.pop_scope();
+						else
+							++frames;
+
+						ctx.enter(std::move(frame), formal);
+
+						// Forms of previous function are not used anymore, so it may be released
+						function = std::move(callable);
+						expr = &function.list()[1];
+					}
+					continue;
+
+				case Value::Type::Memo_Function:
+					{
+						auto &memo = callable.memo_function();
+						Value args(Value::Type::List);
+						for (auto arg = std::next(forms.begin()); arg != forms.end(); ++arg)
+							args.mutable_list().push_back(eval(ctx, *arg));
+						if (auto result = memo.find(args))
+							return leave(std::move(*result));
+
+						// Not a tail call, since result is stored after body is evaluated
+						auto frame = ctx.new_scope();
+						frame.values.assign(args.list().begin(), args.list().end());
+						ctx.enter(std::move(frame), memo.function.list().front());
+						auto result = eval(ctx, memo.function.list()[1]);
+						ctx.pop_scope();
+
+						memo.insert(std::move(args), result);
+						return leave(std::move(result));
+					}
+
+				default:
+					return leave(*expr);
+				}
 			}
 		}
-	}
 
-	return Value::nil();
+		return leave(Value::nil());
+	}
 }
@@ -0,0 +1,518 @@
+#include "patty.hh"
+
+// Bytecode engine. Forms are compiled into chunks of instructions for stack machine.
+// Special forms (if, do, def, fun, list) and arithmetic are compiled directly,
+// every other call goes through Call instruction which evaluates user functions
+// in machine and passes unevaluated arguments to C++ functions like tree evaluator does.
+// Compiled body of function is reused by later calls, while scoping is dynamic, so
+// directly compiled forms are guarded by check that their name still means builtin.
+
+namespace vm
+{
+	enum class Op : std::uint8_t
+	{
+		Constant,      // push constants[arg]
+		Load,          // push value of symbols[arg]
+		Define,        // pop value and assign it to symbols[arg], push nil
+		Pop,           // discard top of the stack
+		Jump,          // continue at arg
+		Jump_If_False, // pop, continue at arg if value is false
+		Add,           // fold arg values from stack with +
+		Subtract,      // fold arg values from stack with -
+		Multiply,      // fold arg values from stack with *
+		Equal,         // compare arg values from stack with first of them
+		Not_Equal,
+		Less,          // compare arg values from stack pairwise
+		Less_Equal,
+		Greater,
+		Greater_Equal,
+		Call,          // perform calls[arg]
+		Guard,         // continue at guards[arg].fallback if symbol is not builtin anymore
+	};
+
+	struct Instruction
+	{
+		Op op;
+		std::uint32_t arg = 0;
+	};
+
+	struct Call_Site;
+	struct Function;
+
+	struct Guard
+	{
+		Value symbol;
+		std::int64_t intrinsic; // index of builtin in Intrinsic::table
+		std::uint32_t fallback = 0;
+	};
+
+	struct Chunk
+	{
+		std::vector<Instruction> code;
+		std::vector<Value> constants;
+		std::vector<Value> symbols;
+		std::vector<Call_Site> calls;
+		std::vector<Guard> guards;
+	};
+
+	struct Call_Site
+	{
+		Value form;
+		Value args; // passed unevaluated to C++ functions, shares elements with form
+		Chunk callee;
+		std::vector<Chunk> arguments; // compiled on first call of user function
+
+		// Global slot that callee resolved to, valid until epoch of context changes
+		unsigned global = 0;
+		std::uint64_t epoch = 0;
+
+		// User function called last time from this call site
+		std::shared_ptr<Function> cached;
+	};
+
+	struct Function
+	{
+		Value definition;
+		Chunk body;
+	};
+
+	struct Compiler
+	{
+		Context &ctx;
+
+		void compile(Chunk &chunk, Value const& value);
+		void compile_call(Chunk &chunk, Value const& value);
+		void compile_generic_call(Chunk &chunk, Value const& value);
+		bool is_intrinsic(Value const& head, std::string_view name);
+
+		std::uint32_t emit(Chunk &chunk, Op op, std::uint32_t arg = 0);
+		std::uint32_t constant(Chunk &chunk, Value value);
+		std::uint32_t symbol(Chunk &chunk, Value const& symbol);
+	};
+
+	struct Machine
+	{
+		Context &ctx;
+		std::vector<Value> stack = {};
+		std::vector<std::shared_ptr<Function>> functions = {};
+
+		void run(Chunk &chunk);
+		void call(Call_Site &site);
+		std::shared_ptr<Function> prepare(Call_Site &site);
+		void bind(Function const& f, std::size_t argc);
+		void compile_arguments(Call_Site &site);
+		std::shared_ptr<Function> function(Value const& definition);
+	};
+}
+
+std::uint32_t vm::Compiler::emit(Chunk &chunk, Op op, std::uint32_t arg)
+{
+	chunk.code.push_back({ op, arg });
+	return chunk.code.size() - 1;
+}
+
+std::uint32_t vm::Compiler::constant(Chunk &chunk, Value value)
+{
+	chunk.constants.push_back(std::move(value));
+	return chunk.constants.size() - 1;
+}
+
+std::uint32_t vm::Compiler::symbol(Chunk &chunk, Value const& symbol)
+{
+	auto it = std::find_if(R(chunk.symbols), [&](Value const& s) {
+		return s.symbol_id() == symbol.symbol_id()
+			&& s.address.kind == symbol.address.kind
+			&& s.address.depth == symbol.address.depth
+			&& s.address.slot == symbol.address.slot;
+	});
+
+	if (it != chunk.symbols.end())
+		return std::distance(chunk.symbols.begin(), it);
+	chunk.symbols.push_back(symbol);
+	return chunk.symbols.size() - 1;
+}
+
+// Special forms are compiled only when they resolve to builtin C++ function,
+// so user can still shadow them. Since compiled body is reused, they are also guarded
+// at runtime (see compile_call)
+bool vm::Compiler::is_intrinsic(Value const& head, std::string_view name)
+{
+	if (head.type != Value::Type::Symbol || head.sval() != name)
+		return false;
+	auto resolved = ctx[head.symbol_id()];
+	return resolved && resolved->type == Value::Type::Cpp_Function && resolved->sval() == name;
+}
+
+void vm::Compiler::compile(Chunk &chunk, Value const& value)
+{
+	switch (value.type) {
+	case Value::Type::Sequence:
+	case Value::Type::Int:
+	case Value::Type::Nil:
+	case Value::Type::Cpp_Function:
+	case Value::Type::String:
+	case Value::Type::Int_Vector:
+	case Value::Type::Memo_Function:
+		emit(chunk, Op::Constant, constant(chunk, value));
+		return;
+
+	case Value::Type::Symbol:
+		emit(chunk, Op::Load, symbol(chunk, value));
+		return;
+
+	case Value::Type::List:
+		if (value.list().empty()) {
+			emit(chunk, Op::Constant, constant(chunk, Value::nil()));
+			return;
+		}
+		compile_call(chunk, value);
+		return;
+	}
+}
+
+void vm::Compiler::compile_call(Chunk &chunk, Value const& value)
+{
+	auto const& head = value.list().front();
+	auto const argc = value.list().size() - 1;
+
+	static constexpr auto Folds = std::array {
+		std::tuple { "+"sv,  Op::Add },
+		std::tuple { "-"sv,  Op::Subtract },
+		std::tuple { "*"sv,  Op::Multiply },
+		std::tuple { "=="sv, Op::Equal },
+		std::tuple { "!="sv, Op::Not_Equal },
+		std::tuple { "<"sv,  Op::Less },
+		std::tuple { "<="sv, Op::Less_Equal },
+		std::tuple { ">"sv,  Op::Greater },
+		std::tuple { ">="sv, Op::Greater_Equal },
+	};
+
+	auto const inline_form = [&]() -> bool {
+		for (auto [fold, op] : Folds) {
+			if (argc >= 1 && is_intrinsic(head, fold)) {
+				for (auto const& arg : value.tail())
+					compile(chunk, arg);
+				emit(chunk, op, argc);
+				return true;
+			}
+		}
+
+		if (argc >= 2 && is_intrinsic(head, "if")) {
+			compile(chunk, value.at(1));
+			auto to_else = emit(chunk, Op::Jump_If_False);
+			compile(chunk, value.at(2));
+			auto to_end = emit(chunk, Op::Jump);
+			chunk.code[to_else].arg = chunk.code.size();
+			if (argc > 2)
+				compile(chunk, value.at(3));
+			else
+				emit(chunk, Op::Constant, constant(chunk, Value::nil()));
+			chunk.code[to_end].arg = chunk.code.size();
+			return true;
+		}
+
+		if (argc >= 1 && is_intrinsic(head, "do")) {
+			for (auto const& arg : value.tail()) {
+				compile(chunk, arg);
+				emit(chunk, Op::Pop);
+			}
+			chunk.code.pop_back();
+			return true;
+		}
+
+		if (argc >= 2 && is_intrinsic(head, "def") && value.at(1).type == Value::Type::Symbol) {
+			compile(chunk, value.at(2));
+			emit(chunk, Op::Define, symbol(chunk, value.at(1)));
+			return true;
+		}
+
+		if (is_intrinsic(head, "fun") || is_intrinsic(head, "list")) {
+			Value args(Value::Type::List);
+			args.mutable_list().assign(CR(value.tail()));
+			if (is_intrinsic(head, "fun"))
+				resolve_function(ctx, args);
+			emit(chunk, Op::Constant, constant(chunk, std::move(args)));
+			return true;
+		}
+		return false;
+	};
+
+	// Head is checked to resolve to builtin before directly compiled form is run,
+	// otherwise form is performed as regular call
+	auto const guard = chunk.guards.size();
+	auto const guard_at = emit(chunk, Op::Guard, guard);
+	if (head.type == Value::Type::Symbol)
+		chunk.guards.push_back({ head, 0 });
+
+	if (!inline_form()) {
+		chunk.code.erase(chunk.code.begin() + guard_at);
+		chunk.guards.resize(guard);
+		compile_generic_call(chunk, value);
+		return;
+	}
+
+	chunk.guards[guard].intrinsic = ctx[head.symbol_id()]->ival;
+	auto const to_end = emit(chunk, Op::Jump);
+	chunk.guards[guard].fallback = chunk.code.size();
+	compile_generic_call(chunk, value);
+	chunk.code[to_end].arg = chunk.code.size();
+}
+
+void vm::Compiler::compile_generic_call(Chunk &chunk, Value const& value)
+{
+	auto &site = chunk.calls.emplace_back();
+	site.form = value;
+	auto args = value.list();
+	args.pop_front();
+	site.args = Value(std::move(args));
+	compile(site.callee, value.list().front());
+	emit(chunk, Op::Call, chunk.calls.size() - 1);
+}
+
+std::shared_ptr<vm::Function> vm::Machine::function(Value const& definition)
+{
+	for (auto const& f : functions)
+		if (f->definition == definition)
+			return f;
+
+	auto &f = functions.emplace_back(std::make_shared<Function>());
+	f->definition = definition;
+	Compiler{ctx}.compile(f->body, definition.at(1));
+	return f;
+}
+
+// Evaluates callee of call site. Result of C++ function is pushed on the stack right away,
+// for user function its arguments are pushed and function is returned to be entered by caller
+std::shared_ptr<vm::Function> vm::Machine::prepare(Call_Site &site)
+{
+	// Most callees are just names, so avoid copying whole function out of scope
+	Value evaluated;
+	Value const* callable = &evaluated;
+	if (site.epoch == ctx.epoch && ctx.globals[site.global].shadowed == 0) {
+		callable = &ctx.globals[site.global].value;
+	} else if (auto const& callee = site.callee; callee.code.size() == 1 && callee.code.front().op == Op::Load) {
+		auto const& name = callee.symbols[callee.code.front().arg];
+		callable = ctx[name];
+		if (!callable)
+			error_fatal("Cannot resolve symbol {}"_format(name.sval()));
+
+		// Defined globals are not reassigned, so until next definition the name resolves
+		// to the same one, unless local hides it
+		if (auto const id = name.symbol_id(); id < ctx.global_slots.size() && ctx.global_slots[id] != Context::No_Slot
+				&& callable == &ctx.globals[ctx.global_slots[id]].value) {
+			site.global = ctx.global_slots[id];
+			site.epoch = ctx.epoch;
+		}
+	} else {
+		run(site.callee);
+		evaluated = std::move(stack.back());
+		stack.pop_back();
+	}
+
+	switch (callable->type) {
+	case Value::Type::Cpp_Function:
+		stack.push_back(callable->intrinsic().function(ctx, site.args));
+		return nullptr;
+
+	case Value::Type::List:
+		{
+			if (!site.cached || site.cached->definition != *callable)
+				site.cached = function(*callable);
+			compile_arguments(site);
+
+			assert(site.cached->definition.list().front().type == Value::Type::List);
+			assert(site.cached->definition.list().front().list().size() == site.arguments.size()); // TODO not all parameters were provided
+
+			// Same as in tree evaluator, arguments are evaluated in scope of the caller
+			for (auto &arg : site.arguments)
+				run(arg);
+			return site.cached;
+		}
+
+	case Value::Type::Memo_Function:
+		{
+			// Kept alive, since evaluation of arguments may move globals
+			auto const memoized = *callable;
+			auto &memo = memoized.memo_function();
+			compile_arguments(site);
+			for (auto &arg : site.arguments)
+				run(arg);
+
+			auto const argc = site.arguments.size();
+			Value args(Value::List(stack.end() - argc, stack.end()));
+			if (auto result = memo.find(args)) {
+				stack.resize(stack.size() - argc);
+				stack.push_back(std::move(*result));
+				return nullptr;
+			}
+
+			auto const f = function(memo.function);
+			ctx.push_scope();
+			bind(*f, argc);
+			run(f->body);
+			ctx.pop_scope();
+			memo.insert(std::move(args), stack.back());
+		}
+		return nullptr;
+
+	default:
+		stack.push_back(site.form);
+		return nullptr;
+	}
+}
+
+// Arguments are needed only by user functions, so they are not compiled for call sites that
+// call C++ functions or serve as fallback of guarded forms that are never taken
+void vm::Machine::compile_arguments(Call_Site &site)
+{
+	if (site.arguments.size() == site.args.list().size())
+		return;
+	for (auto const& arg : site.args.list())
+		Compiler{ctx}.compile(site.arguments.emplace_back(), arg);
+}
+
+// Moves arguments from the stack into parameters of innermost scope
+void vm::Machine::bind(Function const& f, std::size_t argc)
+{
+	auto arg = stack.end() - argc;
+	for (auto const& param : f.definition.list().front().list()) {
+		assert(param.type == Value::Type::Symbol);
+		ctx.assign(param.symbol_id(), std::move(*arg++));
+	}
+	stack.resize(stack.size() - argc);
+}
+
+void vm::Machine::call(Call_Site &site)
+{
+	if (auto const f = prepare(site)) {
+		ctx.push_scope();
+		bind(*f, site.arguments.size());
+		run(f->body);
+		ctx.pop_scope();
+	}
+}
+
+// Call is in tail position when nothing but jumps to the end of chunk follows it
+static bool is_tail(vm::Chunk const& chunk, std::uint32_t ip)
+{
+	while (ip < chunk.code.size() && chunk.code[ip].op == vm::Op::Jump)
+		ip = chunk.code[ip].arg;
+	return ip == chunk.code.size();
+}
+
+// Calls to user functions in tail position continue with body of callee
+// instead of recursion, like in tree evaluator
+void vm::Machine::run(Chunk &entry)
+{
+	Chunk *chunk = &entry;
+	unsigned frames = 0; // scopes of functions entered by tail calls
+
+	auto const fold = [this](std::uint32_t count, auto op) {
+		auto first = stack.end() - count;
+		for (auto it = std::next(first); it != stack.end(); ++it)
+			((*first).*op)(*it);
+		stack.erase(std::next(first), stack.end());
+	};
+
+	auto const compare = [this](std::uint32_t count, auto op) {
+		auto first = stack.end() - count;
+		bool result = true;
+		for (auto it = std::next(first); result && it != stack.end(); ++it)
+			result = op(*std::prev(it), *it);
+		stack.erase(first, stack.end());
+		stack.push_back(Value::integer(result));
+	};
+
+	auto const compare_first = [this](std::uint32_t count, auto op) {
+		auto first = stack.end() - count;
+		bool result = std::all_of(std::next(first), stack.end(), [&](Value const& v) { return ((*first).*op)(v); });
+		stack.erase(first, stack.end());
+		stack.push_back(Value::integer(result));
+	};
+
+	for (std::uint32_t ip = 0; ip < chunk->code.size();) {
+		auto const [op, arg] = chunk->code[ip++];
+		switch (op) {
+		case Op::Constant:
+			stack.push_back(chunk->constants[arg]);
+			break;
+
+		case Op::Load:
+			if (auto resolved = ctx[chunk->symbols[arg]]; resolved) {
+				stack.push_back(*resolved);
+			} else {
+				error_fatal("Cannot resolve symbol {}"_format(chunk->symbols[arg].sval()));
+			}
+			break;
+
+		case Op::Define:
+			ctx.assign(chunk->symbols[arg].symbol_id(), std::move(stack.back()));
+			stack.back() = Value::nil();
+			break;
+
+		case Op::Pop:
+			stack.pop_back();
+			break;
+
+		case Op::Jump:
+			ip = arg;
+			break;
+
+		case Op::Jump_If_False:
+			if (!stack.back().coarce_bool())
+				ip = arg;
+			stack.pop_back();
+			break;
+
+		case Op::Add:      fold(arg, &Value::operator+=); break;
+		case Op::Subtract: fold(arg, &Value::operator-=); break;
+		case Op::Multiply: fold(arg, &Value::operator*=); break;
+
+		case Op::Equal:     compare_first(arg, &Value::operator==); break;
+		case Op::Not_Equal: compare_first(arg, &Value::operator!=); break;
+
+		case Op::Less:          compare(arg, [](Value const& a, Value const& b) { return a.ival <  b.ival; }); break;
+		case Op::Less_Equal:    compare(arg, [](Value const& a, Value const& b) { return a.ival <= b.ival; }); break;
+		case Op::Greater:       compare(arg, [](Value const& a, Value const& b) { return a.ival >  b.ival; }); break;
+		case Op::Greater_Equal: compare(arg, [](Value const& a, Value const& b) { return a.ival >= b.ival; }); break;
+
+		case Op::Guard:
+			if (auto const& guard = chunk->guards[arg]; auto const resolved = ctx[guard.symbol]) {
+				if (resolved->type == Value::Type::Cpp_Function && resolved->ival == guard.intrinsic)
+					break;
+			}
+			ip = chunk->guards[arg].fallback;
+			break;
+
+		case Op::Call:
+			if (!is_tail(*chunk, ip)) {
+				call(chunk->calls[arg]);
+			} else if (auto &site = chunk->calls[arg]; auto const f = prepare(site)) {
+				if (frames > 0 && ctx.rebinds_all(f->definition.list().front()))
+					ctx.pop_scope();
+				else
+					++frames;
+
+				ctx.push_scope();
+				bind(*f, site.arguments.size());
+				chunk = &f->body;
+				ip = 0;
+			}
+			break;
+		}
+	}
+
+	for (; frames > 0; --frames)
+		ctx.pop_scope();
+}
+
+Value execute(Context &ctx, Value const& value)
+{
+	vm::Chunk chunk;
+	vm::Compiler{ctx}.compile(chunk, value);
+
+	vm::Machine machine{ctx, {}};
+	machine.run(chunk);
+	assert(machine.stack.size() == 1);
+	return std::move(machine.stack.back());
+}